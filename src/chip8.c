@@ -1,15 +1,51 @@
+// clock_gettime and syscall are hidden by a strict -std=c11, which .clang-tidy compiles with
+#define _DEFAULT_SOURCE
+
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
 #include <raylib.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#else
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 
 #define FILENAME            "../test/SCTEST"
 
 #define UNUSED(x)           (void)(x)
 #define ARRAY_SIZE(arr)     (sizeof((arr)) / sizeof((arr)[0]))
+#define LOG(...)                 \
+    do {                         \
+        if (verbose) {           \
+            printf(__VA_ARGS__); \
+        }                        \
+    } while (0)
 
 #define NNN(op)             ((uint16_t)(op) & 0x0FFF)
 #define N(op)               ((uint8_t)(op) & 0x000F)
@@ -17,22 +53,55 @@
 #define Y(op)               ((uint8_t)((op) >> 4) & 0x0F)
 #define KK(op)              ((uint8_t)(op) & 0x00FF)
 
-#define RAM_SIZE            0x1000 // 4KB of RAM
+#define RAM_SIZE            0x1000  // 4KB of RAM
+#define XO_RAM_SIZE         0x10000 // 64KB in XO-CHIP mode, always allocated so a 16 bit address can't leave RAM
 #define FONT_BASE_ADDR      0x050
+#define BIG_FONT_BASE_ADDR  0x0A0
 #define PROGRAM_BASE_ADDR   0x200
-#define PROGRAM_REGION_END  0xFFF
-#define PROGRAM_REGION_SIZE (PROGRAM_REGION_END - PROGRAM_BASE_ADDR + 1)
 
 #define WIDTH               64
 #define HEIGHT              32
+#define HIRES_WIDTH         128
+#define HIRES_HEIGHT        64
+#define PLANES              2
+#define ROW_WORDS           (HIRES_WIDTH / 64) // Each framebuffer row is packed into 64 bit words, leftmost pixel in the MSB
 #define SCALE               10
 #define CPU_STEPS_PER_FRAME 10
 #define FPS_TARGET          60
+#define DEFAULT_SEED        0
+#define TEST_DIR            "../test"
 
 #define FONT_BYTES          (16 * 5)
+#define BIG_FONT_BYTES      (16 * 10)
+
+#define CATALOG_FILENAME    ".chip8-catalog"
+#define CATALOG_MAGIC       0x54414338U // "8CAT" on disk (little endian)
+#define CATALOG_VERSION     2
+#define CATALOG_EMPTY       UINT32_MAX
+#define ROM_PATH_MAX        256
+
+#define TRACE_CAPACITY      (1 << 16) // Spans kept per thread, the oldest are overwritten first
+#define TRACE_COUNTERS      3
+
+#define DEBUG_MAX_WATCHES   16
+#define DEBUG_WATCH_I       (1U << 16)
+
+#define STREAM_MAGIC        0x42463843U // "C8FB" on disk (little endian)
+#define STREAM_VERSION      1
+#define STREAM_RECORD_MAX   (8 + HIRES_HEIGHT * (1 + PLANES * ROW_WORDS * 8)) // A record header and every row of both planes
+#define GIF_FILENAME        "recording.gif"
+#define GIF_MIN_CODE_SIZE   2    // Bits per pixel of the 4 colour palette
+#define GIF_MAX_CODE        4095 // GIF codes are at most 12 bits
+#define GIF_MIN_DELAY       2    // Centiseconds
+
+#define CONFORMANCE_MAX_FRAMES    3600 // A minute of emulated time
+#define CONFORMANCE_STABLE_FRAMES 120  // Frames without a framebuffer change before a ROM counts as finished
+#define SCTEST_ERROR_TEXT_X       32   // Where test/sctest.c8 starts drawing the error number after "ERROR"
 
 #pragma region System
 
+bool verbose = true; // Trace every opcode to stdout, see LOG()
+
 // clang-format off
 const uint8_t font_sprites[FONT_BYTES] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
@@ -54,6 +123,36 @@ const uint8_t font_sprites[FONT_BYTES] = {
 };
 // clang-format on
 
+// SUPER-CHIP 8x10 digits for Fx30, with XO-CHIP's A-F
+// clang-format off
+const uint8_t big_font_sprites[BIG_FONT_BYTES] = {
+    0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+    0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+    0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+    0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+    0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+    0x3E, 0x7C, 0xC0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+    0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, // 9
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0, // F
+};
+// clang-format on
+
+typedef enum {
+    QUIRKS_CHIP8,
+    QUIRKS_SCHIP,
+    QUIRKS_XOCHIP, // Each machine extends the ones before it, see has_extension
+} QuirkProfile;
+
+static const char *quirk_names[] = {"CHIP-8", "SUPER-CHIP", "XO-CHIP"};
+
 typedef struct {
     int qwerty_key;
     uint8_t chip8_key;
@@ -76,12 +175,22 @@ static const KeyMapping valid_keys[] = {
 };
 // clang-format on
 
-uint8_t get_key_pressed(void)
+// State of the chip8 keypad, sampled once per frame so opcodes never call into raylib
+bool keypad[16];
+
+void poll_keypad(void)
 {
     for (size_t i = 0; i < ARRAY_SIZE(valid_keys); i++) {
-        KeyMapping key = valid_keys[i];
-        if (IsKeyDown(key.qwerty_key)) {
-            return key.chip8_key;
+        KeyMapping key        = valid_keys[i];
+        keypad[key.chip8_key] = IsKeyDown(key.qwerty_key);
+    }
+}
+
+uint8_t get_key_pressed(void)
+{
+    for (uint8_t key = 0; key < ARRAY_SIZE(keypad); key++) {
+        if (keypad[key]) {
+            return key;
         }
     }
     return 0xFF;
@@ -89,14 +198,8 @@ uint8_t get_key_pressed(void)
 
 bool is_key_pressed(uint8_t chip8_key)
 {
-    for (size_t i = 0; i < ARRAY_SIZE(valid_keys); i++) {
-        KeyMapping key = valid_keys[i];
-        if (chip8_key == key.chip8_key) {
-            return IsKeyDown(key.qwerty_key);
-        }
-    }
-    assert(false);
-    return false;
+    assert(chip8_key < ARRAY_SIZE(keypad));
+    return keypad[chip8_key];
 }
 
 uint8_t V[16];    // Registers Vx (V0-VF) (general purpose)
@@ -111,7 +214,204 @@ uint16_t stack_ptr;
 uint16_t PC;
 uint8_t *RAM;
 
-uint8_t framebuffer[HEIGHT][WIDTH];
+QuirkProfile quirks; // Which machine is being emulated
+uint32_t ram_size;   // Addressable RAM for the current mode
+uint8_t rpl[16];     // SUPER-CHIP HP48 flag registers, Fx75/Fx85
+uint8_t audio_pattern[16];
+uint8_t pitch;
+
+// Bit planes, one bit per pixel. Lo-res uses the top left WIDTH x HEIGHT corner, which is the first word of the first HEIGHT rows.
+uint64_t framebuffer[PLANES][HIRES_HEIGHT][ROW_WORDS];
+uint16_t screen_width;
+uint16_t screen_height;
+uint8_t plane_mask; // Planes that draw, clear and scroll act on, selected with XO-CHIP Fn01
+uint64_t dirty_rows; // Bit y is set once row y of either plane changes, the frame stream clears it after sending the row
+
+static inline uint16_t row_words(void)
+{
+    return screen_width / 64;
+}
+
+bool framebuffer_pixel(uint8_t plane, uint16_t x, uint16_t y)
+{
+    return (framebuffer[plane][y][x / 64] >> (63 - x % 64)) & 1;
+}
+
+// Extension opcodes only decode on the machine that introduced them and the ones built on it.
+// Anywhere else they mean whatever they did on the original CHIP-8, so a CHIP-8 ROM never runs an extension by accident.
+// Behaviour quirks (Fx1E's VF, Fx55/Fx65 moving I, 8xy6/8xyE shifting Vy, Bxnn) belong to one machine each and test quirks directly.
+static inline bool has_extension(QuirkProfile introduced_by)
+{
+    return quirks >= introduced_by;
+}
+
+// In XO-CHIP mode the skips step over the whole of the 4 byte F000 nnnn
+void skip_next_opcode(void)
+{
+    bool long_load = has_extension(QUIRKS_XOCHIP) && RAM[PC] == 0xF0 && RAM[(uint16_t)(PC + 1)] == 0x00;
+    PC             = (uint16_t)(PC + (long_load ? 4 : 2));
+}
+
+// xoshiro256** (Blackman & Vigna). Seeded by machine_reset and saved in snapshots, so runs are reproducible from the seed alone.
+typedef struct {
+    uint64_t s[4];
+} Rng;
+
+Rng rng;
+
+static inline uint64_t rotl64(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+uint64_t rng_next(Rng *r)
+{
+    uint64_t result = rotl64(r->s[1] * 5, 7) * 9;
+    uint64_t t      = r->s[1] << 17;
+
+    r->s[2] ^= r->s[0];
+    r->s[3] ^= r->s[1];
+    r->s[1] ^= r->s[2];
+    r->s[0] ^= r->s[3];
+    r->s[2] ^= t;
+    r->s[3] = rotl64(r->s[3], 45);
+
+    return result;
+}
+
+// Advance the generator by 2^128 draws
+void rng_jump(Rng *r)
+{
+    static const uint64_t jump[] = {0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL};
+
+    uint64_t s[4] = {0};
+    for (size_t i = 0; i < ARRAY_SIZE(jump); i++) {
+        for (int b = 0; b < 64; b++) {
+            if (jump[i] & (1ULL << b)) {
+                s[0] ^= r->s[0];
+                s[1] ^= r->s[1];
+                s[2] ^= r->s[2];
+                s[3] ^= r->s[3];
+            }
+            rng_next(r);
+        }
+    }
+    memcpy(r->s, s, sizeof(s));
+}
+
+// The seed is expanded with splitmix64, then jumped ahead once per stream.
+// Workers sharing a seed but using different streams draw from non-overlapping parts of the sequence.
+void rng_seed(Rng *r, uint64_t seed, uint32_t stream)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(r->s); i++) {
+        seed += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = seed;
+        z          = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z          = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        r->s[i]    = z ^ (z >> 31);
+    }
+
+    for (uint32_t i = 0; i < stream; i++) {
+        rng_jump(r);
+    }
+}
+
+// Everything needed to put the machine back exactly where it was, including where the RNG is in its sequence
+typedef struct {
+    uint8_t V[16];
+    uint16_t I;
+    uint16_t DT;
+    uint16_t ST;
+    uint16_t stack[16];
+    uint16_t stack_ptr;
+    uint16_t PC;
+    Rng rng;
+    QuirkProfile quirks;
+    uint8_t rpl[16];
+    uint8_t audio_pattern[16];
+    uint8_t pitch;
+    uint16_t screen_width;
+    uint16_t screen_height;
+    uint8_t plane_mask;
+    uint64_t framebuffer[PLANES][HIRES_HEIGHT][ROW_WORDS];
+    uint8_t RAM[XO_RAM_SIZE]; // Only the first ram_size bytes are saved
+} Snapshot;
+
+void snapshot_save(Snapshot *snapshot)
+{
+    memcpy(snapshot->V, V, sizeof(V));
+    snapshot->I  = I;
+    snapshot->DT = DT;
+    snapshot->ST = ST;
+    memcpy(snapshot->stack, stack, sizeof(stack));
+    snapshot->stack_ptr = stack_ptr;
+    snapshot->PC        = PC;
+    snapshot->rng       = rng;
+    snapshot->quirks    = quirks;
+    memcpy(snapshot->rpl, rpl, sizeof(rpl));
+    memcpy(snapshot->audio_pattern, audio_pattern, sizeof(audio_pattern));
+    snapshot->pitch         = pitch;
+    snapshot->screen_width  = screen_width;
+    snapshot->screen_height = screen_height;
+    snapshot->plane_mask    = plane_mask;
+    memcpy(snapshot->framebuffer, framebuffer, sizeof(framebuffer));
+    memcpy(snapshot->RAM, RAM, ram_size);
+}
+
+void snapshot_restore(const Snapshot *snapshot)
+{
+    memcpy(V, snapshot->V, sizeof(V));
+    I  = snapshot->I;
+    DT = snapshot->DT;
+    ST = snapshot->ST;
+    memcpy(stack, snapshot->stack, sizeof(stack));
+    stack_ptr = snapshot->stack_ptr;
+    PC        = snapshot->PC;
+    rng       = snapshot->rng;
+    quirks    = snapshot->quirks;
+    ram_size  = (quirks == QUIRKS_XOCHIP) ? XO_RAM_SIZE : RAM_SIZE;
+    memcpy(rpl, snapshot->rpl, sizeof(rpl));
+    memcpy(audio_pattern, snapshot->audio_pattern, sizeof(audio_pattern));
+    pitch         = snapshot->pitch;
+    screen_width  = snapshot->screen_width;
+    screen_height = snapshot->screen_height;
+    plane_mask    = snapshot->plane_mask;
+    memcpy(framebuffer, snapshot->framebuffer, sizeof(framebuffer));
+    dirty_rows = UINT64_MAX;
+    memcpy(RAM, snapshot->RAM, ram_size);
+}
+
+bool cpu_fault; // Set by an unknown opcode or a runaway PC, the machine can't continue after that
+
+// Power-on state for the given machine: everything zeroed, the fonts in place and PC at the program start.
+// RAM must already be allocated with XO_RAM_SIZE bytes.
+void machine_reset(QuirkProfile profile, uint64_t seed, uint32_t stream)
+{
+    quirks   = profile;
+    ram_size = (profile == QUIRKS_XOCHIP) ? XO_RAM_SIZE : RAM_SIZE;
+
+    memset(V, 0, sizeof(V));
+    I  = 0;
+    DT = 0;
+    ST = 0;
+    memset(stack, 0, sizeof(stack));
+    stack_ptr = 0;
+    PC        = PROGRAM_BASE_ADDR;
+    memset(RAM, 0, XO_RAM_SIZE);
+    memcpy(RAM + FONT_BASE_ADDR, font_sprites, (size_t)FONT_BYTES);
+    memcpy(RAM + BIG_FONT_BASE_ADDR, big_font_sprites, (size_t)BIG_FONT_BYTES);
+    memset(rpl, 0, sizeof(rpl));
+    memset(audio_pattern, 0, sizeof(audio_pattern));
+    pitch = 0;
+    memset(framebuffer, 0, sizeof(framebuffer));
+    screen_width  = WIDTH;
+    screen_height = HEIGHT;
+    plane_mask    = 0x1;
+    dirty_rows    = UINT64_MAX;
+    memset(keypad, 0, sizeof(keypad));
+    rng_seed(&rng, seed, stream);
+    cpu_fault = false;
+}
 
 #pragma endregion
 #pragma region opcodes
@@ -121,7 +421,7 @@ uint8_t framebuffer[HEIGHT][WIDTH];
 // This opcode is only used on the old computers on which Chip-8 was originally implemented. It is ignored by modern interpreters.
 void op_sys(uint16_t opcode)
 {
-    printf("Called SYS addr\n");
+    LOG("Called SYS addr\n");
     UNUSED(opcode);
 }
 
@@ -129,9 +429,15 @@ void op_sys(uint16_t opcode)
 // Clear the display.
 void op_cls(uint16_t opcode)
 {
-    printf("Called CLS\n");
+    LOG("Called CLS\n");
     UNUSED(opcode);
-    ClearBackground(RAYWHITE);
+
+    for (uint8_t plane = 0; plane < PLANES; plane++) {
+        if (plane_mask & (1 << plane)) {
+            memset(framebuffer[plane], 0, sizeof(framebuffer[plane]));
+        }
+    }
+    dirty_rows = UINT64_MAX;
 }
 
 // 00EE - RET
@@ -139,7 +445,7 @@ void op_cls(uint16_t opcode)
 // The interpreter sets the program counter to the address at the top of the stack, then subtracts 1 from the stack pointer.
 void op_ret(uint16_t opcode)
 {
-    printf("Called RET\n");
+    LOG("Called RET\n");
     UNUSED(opcode);
     PC = stack[stack_ptr];
     stack_ptr--;
@@ -150,7 +456,7 @@ void op_ret(uint16_t opcode)
 // The interpreter sets the program counter to nnn.
 void op_jp_addr(uint16_t opcode)
 {
-    printf("Called JP addr (%04x)\n", NNN(opcode));
+    LOG("Called JP addr (%04x)\n", NNN(opcode));
     PC = NNN(opcode);
 }
 
@@ -159,7 +465,7 @@ void op_jp_addr(uint16_t opcode)
 // The interpreter increments the stack pointer, then puts the current PC on the top of the stack. The PC is then set to nnn.
 void op_call(uint16_t opcode)
 {
-    printf("Called CALL addr (%04x)\n", NNN(opcode));
+    LOG("Called CALL addr (%04x)\n", NNN(opcode));
     stack_ptr++;
     stack[stack_ptr] = PC;
     PC               = NNN(opcode);
@@ -172,10 +478,10 @@ void op_se_vx_byte(uint16_t opcode)
 {
     uint8_t x  = X(opcode);
     uint8_t kk = KK(opcode);
-    printf("Called SE Vx, byte (V%d, %04x)\n", x, kk);
+    LOG("Called SE Vx, byte (V%d, %04x)\n", x, kk);
 
     if (V[x] == kk) {
-        PC += 2;
+        skip_next_opcode();
     }
 }
 
@@ -186,10 +492,10 @@ void op_sne_vx_byte(uint16_t opcode)
 {
     uint8_t x  = X(opcode);
     uint8_t kk = KK(opcode);
-    printf("Called SNE Vx, byte (V%d, %04x)\n", x, kk);
+    LOG("Called SNE Vx, byte (V%d, %04x)\n", x, kk);
 
     if (V[x] != kk) {
-        PC += 2;
+        skip_next_opcode();
     }
 }
 
@@ -200,10 +506,10 @@ void op_se_vx_vy(uint16_t opcode)
 {
     uint8_t x = X(opcode);
     uint8_t y = Y(opcode);
-    printf("Called SE Vx, Vy (V%d, V%d)\n", x, y);
+    LOG("Called SE Vx, Vy (V%d, V%d)\n", x, y);
 
     if (V[x] == V[y]) {
-        PC += 2;
+        skip_next_opcode();
     }
 }
 
@@ -214,7 +520,7 @@ void op_ld_vx_byte(uint16_t opcode)
 {
     uint8_t x  = X(opcode);
     uint8_t kk = KK(opcode);
-    printf("Called LD Vx, byte (V%d, %04x)\n", x, kk);
+    LOG("Called LD Vx, byte (V%d, %04x)\n", x, kk);
 
     V[x] = kk;
 }
@@ -226,9 +532,9 @@ void op_add_vx_byte(uint16_t opcode)
 {
     uint8_t x  = X(opcode);
     uint8_t kk = KK(opcode);
-    printf("Called ADD (V%d, %04x)\n", x, kk);
+    LOG("Called ADD (V%d, %04x)\n", x, kk);
     uint8_t tmp = V[x] + kk;
-    printf("%d + %d = %d\n", V[x], kk, tmp);
+    LOG("%d + %d = %d\n", V[x], kk, tmp);
 
     V[x] = tmp;
 }
@@ -240,7 +546,7 @@ void op_ld_vx_vy(uint16_t opcode)
 {
     uint8_t x = X(opcode);
     uint8_t y = Y(opcode);
-    printf("Called LD Vx, Vy (V%d, V%d)\n", x, y);
+    LOG("Called LD Vx, Vy (V%d, V%d)\n", x, y);
 
     V[x] = V[y];
 }
@@ -252,7 +558,7 @@ void op_or(uint16_t opcode)
 {
     uint8_t x = X(opcode);
     uint8_t y = Y(opcode);
-    printf("Called OR Vx, Vy (V%d, V%d)\n", x, y);
+    LOG("Called OR Vx, Vy (V%d, V%d)\n", x, y);
 
     V[x] = V[x] | V[y];
 }
@@ -264,7 +570,7 @@ void op_and(uint16_t opcode)
 {
     uint8_t x = X(opcode);
     uint8_t y = Y(opcode);
-    printf("Called AND Vx, Vy (V%d, V%d)\n", x, y);
+    LOG("Called AND Vx, Vy (V%d, V%d)\n", x, y);
 
     V[x] = V[x] & V[y];
 }
@@ -276,7 +582,7 @@ void op_xor(uint16_t opcode)
 {
     uint8_t x = X(opcode);
     uint8_t y = Y(opcode);
-    printf("Called XOR Vx, Vy (V%d, V%d)\n", x, y);
+    LOG("Called XOR Vx, Vy (V%d, V%d)\n", x, y);
 
     V[x] = V[x] ^ V[y];
 }
@@ -288,12 +594,12 @@ void op_add_vx_vy(uint16_t opcode)
 {
     uint8_t x = X(opcode);
     uint8_t y = Y(opcode);
-    printf("Called ADD Vx, Vy (V%d, V%d)\n", x, y);
+    LOG("Called ADD Vx, Vy (V%d, V%d)\n", x, y);
 
     uint16_t tmp = V[x] + V[y];
 
     VF = (tmp > 255);
-    printf("%d + %d = %d (%d)\n", V[x], V[y], tmp, V[0xF]);
+    LOG("%d + %d = %d (%d)\n", V[x], V[y], tmp, V[0xF]);
     V[x] = (uint8_t)(tmp & 0xFF);
 }
 
@@ -304,11 +610,11 @@ void op_sub(uint16_t opcode)
 {
     uint8_t x = X(opcode);
     uint8_t y = Y(opcode);
-    printf("Called SUB Vx, Vy (V%d, V%d)\n", x, y);
+    LOG("Called SUB Vx, Vy (V%d, V%d)\n", x, y);
 
     VF           = (V[x] >= V[y]);
     uint16_t tmp = V[x] - V[y];
-    printf("%d - %d = %d\n", V[x], V[y], tmp);
+    LOG("%d - %d = %d\n", V[x], V[y], tmp);
     V[x] = (uint8_t)tmp;
 }
 
@@ -318,10 +624,13 @@ void op_sub(uint16_t opcode)
 void op_shr(uint16_t opcode)
 {
     uint8_t x = X(opcode);
-    printf("Called SHR Vx {, Vy} (V%d)\n", x);
+    uint8_t y = Y(opcode);
+    LOG("Called SHR Vx {, Vy} (V%d, V%d)\n", x, y);
 
-    VF   = V[x] & 1;
-    V[x] = V[x] >> 1;
+    // XO-CHIP keeps the original interpreter's Vx = Vy SHR 1
+    uint8_t value = (quirks == QUIRKS_XOCHIP) ? V[y] : V[x];
+    VF            = value & 1;
+    V[x]          = value >> 1;
 }
 
 // 8xy7 - SUBN Vx, Vy
@@ -331,12 +640,12 @@ void op_subn(uint16_t opcode)
 {
     uint8_t x = X(opcode);
     uint8_t y = Y(opcode);
-    printf("Called SUBN Vx, Vy (V%d, V%d)\n", x, y);
+    LOG("Called SUBN Vx, Vy (V%d, V%d)\n", x, y);
 
     VF           = V[y] >= V[x];
     uint16_t tmp = V[y] - V[x];
 
-    printf("%d - %d = %d\n", V[x], V[y], tmp);
+    LOG("%d - %d = %d\n", V[x], V[y], tmp);
     V[x] = (uint8_t)(tmp);
 }
 
@@ -346,10 +655,13 @@ void op_subn(uint16_t opcode)
 void op_shl(uint16_t opcode)
 {
     uint8_t x = X(opcode);
-    printf("Called SHL Vx {, Vy} (V%d)\n", x);
+    uint8_t y = Y(opcode);
+    LOG("Called SHL Vx {, Vy} (V%d, V%d)\n", x, y);
 
-    VF = (V[x] & (0x80)) >> 7;
-    V[x] <<= 1;
+    // XO-CHIP keeps the original interpreter's Vx = Vy SHL 1
+    uint8_t value = (quirks == QUIRKS_XOCHIP) ? V[y] : V[x];
+    VF            = (value & (0x80)) >> 7;
+    V[x]          = (uint8_t)(value << 1);
 }
 
 // 9xy0 - SNE Vx, Vy
@@ -359,10 +671,10 @@ void op_sne_vx_vy(uint16_t opcode)
 {
     uint8_t x = X(opcode);
     uint8_t y = Y(opcode);
-    printf("Called SNE Vx, Vy (V%d, V%d)\n", x, y);
+    LOG("Called SNE Vx, Vy (V%d, V%d)\n", x, y);
 
     if (V[x] != V[y]) {
-        PC += 2;
+        skip_next_opcode();
     }
 }
 
@@ -371,7 +683,7 @@ void op_sne_vx_vy(uint16_t opcode)
 // The value of register I is set to nnn.
 void op_ld_i_addr(uint16_t opcode)
 {
-    printf("Called LD I, addr (%04x)\n", NNN(opcode));
+    LOG("Called LD I, addr (%04x)\n", NNN(opcode));
     I = NNN(opcode);
 }
 
@@ -380,8 +692,11 @@ void op_ld_i_addr(uint16_t opcode)
 // The program counter is set to nnn plus the value of V0.
 void op_jp_v0_addr(uint16_t opcode)
 {
-    printf("Called JP V0, addr (%04x)\n", NNN(opcode));
-    PC = NNN(opcode) + V[0];
+    LOG("Called JP V0, addr (%04x)\n", NNN(opcode));
+
+    // SUPER-CHIP reads it as Bxnn, a jump to xnn plus Vx
+    uint8_t offset = (quirks == QUIRKS_SCHIP) ? X(opcode) : 0;
+    PC             = NNN(opcode) + V[offset];
 }
 
 // Cxkk - RND Vx, byte
@@ -392,11 +707,42 @@ void op_rnd(uint16_t opcode)
 {
     uint8_t x  = X(opcode);
     uint8_t kk = KK(opcode);
-    printf("Called RND Vx, byte (V%d, %04x)\n", x, kk);
-    uint8_t rnd = (uint8_t)(rand() & 0xFF);
+    LOG("Called RND Vx, byte (V%d, %04x)\n", x, kk);
+    uint8_t rnd = (uint8_t)(rng_next(&rng) >> 56);
     V[x]        = kk & rnd;
 }
 
+// XOR one sprite row into a framebuffer row, wrapping around the right edge of the screen.
+// bits holds the sprite row left aligned, 8 or 16 pixels wide. Returns true if a lit pixel was turned off.
+bool xor_sprite_row(uint64_t *row, uint16_t bits, uint16_t x)
+{
+    uint64_t mask[ROW_WORDS] = {(uint64_t)bits << 48, 0};
+
+    if (screen_width == 64) {
+        mask[0] = x ? (mask[0] >> x) | (mask[0] << (64 - x)) : mask[0];
+    } else {
+        // Rotate the 128 bit row right by x
+        if (x >= 64) {
+            mask[1] = mask[0];
+            mask[0] = 0;
+            x      -= 64;
+        }
+        if (x) {
+            uint64_t hi = mask[0];
+            uint64_t lo = mask[1];
+            mask[0]     = (hi >> x) | (lo << (64 - x));
+            mask[1]     = (lo >> x) | (hi << (64 - x));
+        }
+    }
+
+    bool collision = false;
+    for (uint16_t word = 0; word < row_words(); word++) {
+        collision |= (row[word] & mask[word]) != 0;
+        row[word] ^= mask[word];
+    }
+    return collision;
+}
+
 // Dxyn - DRW Vx, Vy, nibble
 // Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision.
 // The interpreter reads n bytes from memory, starting at the address stored in I.
@@ -406,31 +752,37 @@ void op_rnd(uint16_t opcode)
 // See opcode 8xy3 for more information on XOR, and section 2.4, Display, for more information on the Chip-8 screen and sprites.
 void op_drw(uint16_t opcode)
 {
-    VF = 0;
-
-    uint8_t vx = V[X(opcode)];
-    uint8_t vy = V[Y(opcode)];
-    uint8_t n  = N(opcode);
-    printf("Called DRW Vx, Vy, nibble (V%d, V%d, %04x)\n", X(opcode), Y(opcode), n);
-
-    for (uint8_t row = 0; row < n; row++) {
-        uint8_t byte = RAM[I + row];
-
-        for (uint8_t col = 0; col < 8; col++) {
-            uint8_t sprite_bit = (byte >> (7 - col)) & 0x01;
+    uint8_t x = X(opcode);
+    uint8_t y = Y(opcode);
+    uint8_t n = N(opcode);
+    LOG("Called DRW Vx, Vy, nibble (V%d, V%d, %04x)\n", x, y, n);
+
+    // Dxy0 draws a 16x16 sprite, two bytes per row, outside of plain CHIP-8
+    bool big         = (n == 0) && has_extension(QUIRKS_SCHIP);
+    uint8_t rows     = big ? 16 : n;
+    uint16_t vx      = V[x] % screen_width;
+    uint16_t vy      = V[y] % screen_height;
+    uint16_t address = I;
+    bool collision   = false;
+
+    for (uint8_t plane = 0; plane < PLANES; plane++) {
+        if (!(plane_mask & (1 << plane))) {
+            continue;
+        }
 
-            if (sprite_bit == 0) {
-                continue;
+        for (uint8_t row = 0; row < rows; row++) {
+            uint16_t bits = (uint16_t)(RAM[address++] << 8);
+            if (big) {
+                bits |= RAM[address++];
             }
 
-            uint8_t px = (vx + col) % WIDTH;
-            uint8_t py = (vy + row) % HEIGHT;
-            if (framebuffer[py][px] == 1) {
-                VF = 1;
-            }
-            framebuffer[py][px] ^= 1;
+            uint16_t line = (uint16_t)((vy + row) % screen_height);
+            collision    |= xor_sprite_row(framebuffer[plane][line], bits, vx);
+            dirty_rows   |= 1ULL << line;
         }
     }
+
+    VF = collision;
 }
 
 // Ex9E - SKP Vx
@@ -439,10 +791,10 @@ void op_drw(uint16_t opcode)
 void op_skp(uint16_t opcode)
 {
     uint8_t x = X(opcode);
-    printf("Called SKP Vx (V%d)\n", x);
+    LOG("Called SKP Vx (V%d)\n", x);
 
     if (is_key_pressed(V[x])) {
-        PC += 2;
+        skip_next_opcode();
     }
 }
 
@@ -452,10 +804,10 @@ void op_skp(uint16_t opcode)
 void op_sknp(uint16_t opcode)
 {
     uint8_t x = X(opcode);
-    printf("Called SKNP Vx (V%d)\n", x);
+    LOG("Called SKNP Vx (V%d)\n", x);
 
     if (!is_key_pressed(V[x])) {
-        PC += 2;
+        skip_next_opcode();
     }
 }
 
@@ -465,23 +817,23 @@ void op_sknp(uint16_t opcode)
 void op_ld_vx_dt(uint16_t opcode)
 {
     uint8_t x = X(opcode);
-    printf("Called LD Vx, DT (V%d)\n", x);
+    LOG("Called LD Vx, DT (V%d)\n", x);
     V[x] = (uint8_t)DT;
 }
 
 // Fx0A - LD Vx, K
 // Wait for a key press, store the value of the key in Vx.
 // All execution stops until a key is pressed, then the value of that key is stored in Vx.
+// The keypad is only sampled between frames, so waiting means running this opcode again until a key shows up.
 void op_ld_vx_k(uint16_t opcode)
 {
     uint8_t x = X(opcode);
-    printf("Called LD Vx, K (V%d)\n", x);
+    LOG("Called LD Vx, K (V%d)\n", x);
 
-    uint8_t key = 0xFF;
-
-    while (key == 0xFF) {
-        key = get_key_pressed();
-        // TODO add delay here?
+    uint8_t key = get_key_pressed();
+    if (key == 0xFF) {
+        PC -= 2;
+        return;
     }
 
     V[x] = key;
@@ -492,7 +844,7 @@ void op_ld_vx_k(uint16_t opcode)
 // DT is set equal to the value of Vx.
 void op_ld_dt_vx(uint16_t opcode)
 {
-    printf("Called LD DT, Vx\n");
+    LOG("Called LD DT, Vx\n");
     uint8_t x = X(opcode);
     DT        = V[x];
 }
@@ -503,7 +855,7 @@ void op_ld_dt_vx(uint16_t opcode)
 void op_ld_st_vx(uint16_t opcode)
 {
     uint8_t x = X(opcode);
-    printf("Called LD ST, Vx (V%d)\n", x);
+    LOG("Called LD ST, Vx (V%d)\n", x);
     ST = V[x];
 }
 
@@ -513,8 +865,14 @@ void op_ld_st_vx(uint16_t opcode)
 void op_add_i_vx(uint16_t opcode)
 {
     uint8_t x = X(opcode);
-    printf("Called ADD I, Vx (V%d)\n", x);
-    I = V[x] + I;
+    LOG("Called ADD I, Vx (V%d)\n", x);
+
+    // SUPER-CHIP flags I running past the end of RAM in VF, see SCTEST error 24
+    uint32_t sum = (uint32_t)V[x] + I;
+    if (quirks == QUIRKS_SCHIP) {
+        VF = sum >= RAM_SIZE;
+    }
+    I = (uint16_t)sum;
 }
 
 // Fx29 - LD F, Vx
@@ -523,7 +881,7 @@ void op_add_i_vx(uint16_t opcode)
 void op_ld_f_vx(uint16_t opcode)
 {
     uint8_t x = X(opcode);
-    printf("Called LD F, Vx (V%d)\n", x);
+    LOG("Called LD F, Vx (V%d)\n", x);
     I = (uint16_t)(FONT_BASE_ADDR + (V[x] * 5));
 }
 
@@ -534,11 +892,11 @@ void op_ld_f_vx(uint16_t opcode)
 void op_ld_b_vx(uint16_t opcode)
 {
     uint8_t x = X(opcode);
-    printf("Called LD B, Vx(V%d)\n", x);
+    LOG("Called LD B, Vx(V%d)\n", x);
 
-    RAM[I]     = (V[x] / 100);     // Hundreds
-    RAM[I + 1] = (V[x] / 10) % 10; // Tens
-    RAM[I + 2] = (V[x] % 10);      // Ones
+    RAM[I]                 = (V[x] / 100);     // Hundreds
+    RAM[(uint16_t)(I + 1)] = (V[x] / 10) % 10; // Tens
+    RAM[(uint16_t)(I + 2)] = (V[x] % 10);      // Ones
 }
 
 // Fx55 - LD [I], Vx
@@ -547,8 +905,16 @@ void op_ld_b_vx(uint16_t opcode)
 void op_ld_i_vx(uint16_t opcode)
 {
     uint8_t x = X(opcode);
-    printf("Called LD [I], Vx (V%d)\n", x);
-    memcpy(RAM + I, V, x + 1);
+    LOG("Called LD [I], Vx (V%d)\n", x);
+
+    for (uint8_t idx = 0; idx <= x; idx++) {
+        RAM[(uint16_t)(I + idx)] = V[idx];
+    }
+
+    // XO-CHIP leaves I past the last byte stored, like the original interpreter
+    if (quirks == QUIRKS_XOCHIP) {
+        I = (uint16_t)(I + x + 1);
+    }
 }
 
 // Fx65 - LD Vx, [I]
@@ -557,22 +923,246 @@ void op_ld_i_vx(uint16_t opcode)
 void op_ld_vx_i(uint16_t opcode)
 {
     uint8_t x = X(opcode);
-    printf("Called LD Vx, [I] (V%d)\n", x);
+    LOG("Called LD Vx, [I] (V%d)\n", x);
 
     for (uint8_t idx = 0; idx <= x; idx++) {
-        printf("Writing %d to V%d\n", RAM[I + idx], idx);
-        V[idx] = RAM[I + idx];
+        LOG("Writing %d to V%d\n", RAM[(uint16_t)(I + idx)], idx);
+        V[idx] = RAM[(uint16_t)(I + idx)];
+    }
+
+    // XO-CHIP leaves I past the last byte read, like the original interpreter
+    if (quirks == QUIRKS_XOCHIP) {
+        I = (uint16_t)(I + x + 1);
+    }
+}
+
+// SUPER-CHIP and XO-CHIP extensions. Scrolls move by pixels of the current resolution.
+
+// 00Cn - SCD nibble
+// Scroll the display down n pixels.
+void op_scd(uint16_t opcode)
+{
+    uint8_t n = N(opcode);
+    LOG("Called SCD nibble (%d)\n", n);
+
+    for (uint8_t plane = 0; plane < PLANES; plane++) {
+        if (plane_mask & (1 << plane)) {
+            memmove(framebuffer[plane][n], framebuffer[plane][0], (size_t)(screen_height - n) * sizeof(framebuffer[plane][0]));
+            memset(framebuffer[plane][0], 0, n * sizeof(framebuffer[plane][0]));
+        }
+    }
+    dirty_rows = UINT64_MAX;
+}
+
+// 00Dn - SCU nibble
+// Scroll the display up n pixels (XO-CHIP).
+void op_scu(uint16_t opcode)
+{
+    uint8_t n = N(opcode);
+    LOG("Called SCU nibble (%d)\n", n);
+
+    for (uint8_t plane = 0; plane < PLANES; plane++) {
+        if (plane_mask & (1 << plane)) {
+            memmove(framebuffer[plane][0], framebuffer[plane][n], (size_t)(screen_height - n) * sizeof(framebuffer[plane][0]));
+            memset(framebuffer[plane][screen_height - n], 0, n * sizeof(framebuffer[plane][0]));
+        }
+    }
+    dirty_rows = UINT64_MAX;
+}
+
+// 00FB - SCR
+// Scroll the display right 4 pixels.
+void op_scr(uint16_t opcode)
+{
+    LOG("Called SCR\n");
+    UNUSED(opcode);
+
+    for (uint8_t plane = 0; plane < PLANES; plane++) {
+        if (!(plane_mask & (1 << plane))) {
+            continue;
+        }
+        for (uint16_t y = 0; y < screen_height; y++) {
+            uint64_t *row = framebuffer[plane][y];
+            for (uint16_t word = row_words(); word-- > 0;) {
+                row[word] = (row[word] >> 4) | (word > 0 ? row[word - 1] << 60 : 0);
+            }
+        }
+    }
+    dirty_rows = UINT64_MAX;
+}
+
+// 00FC - SCL
+// Scroll the display left 4 pixels.
+void op_scl(uint16_t opcode)
+{
+    LOG("Called SCL\n");
+    UNUSED(opcode);
+
+    for (uint8_t plane = 0; plane < PLANES; plane++) {
+        if (!(plane_mask & (1 << plane))) {
+            continue;
+        }
+        for (uint16_t y = 0; y < screen_height; y++) {
+            uint64_t *row = framebuffer[plane][y];
+            for (uint16_t word = 0; word < row_words(); word++) {
+                row[word] = (row[word] << 4) | (word + 1 < row_words() ? row[word + 1] >> 60 : 0);
+            }
+        }
+    }
+    dirty_rows = UINT64_MAX;
+}
+
+// 00FD - EXIT
+// Exit the interpreter. The program stays parked on this opcode.
+void op_exit(uint16_t opcode)
+{
+    LOG("Called EXIT\n");
+    UNUSED(opcode);
+    PC -= 2;
+}
+
+// 00FE - LOW / 00FF - HIGH
+// Switch to 64x32 or 128x64 and clear the display.
+void op_resolution(uint16_t opcode)
+{
+    bool hires = opcode == 0x00FF;
+    LOG("Called %s\n", hires ? "HIGH" : "LOW");
+
+    screen_width  = hires ? HIRES_WIDTH : WIDTH;
+    screen_height = hires ? HIRES_HEIGHT : HEIGHT;
+    memset(framebuffer, 0, sizeof(framebuffer));
+    dirty_rows = UINT64_MAX;
+}
+
+// 5xy2 - LD [I], Vx - Vy
+// Store registers Vx through Vy in memory starting at location I, without changing I (XO-CHIP). x may be above y.
+void op_ld_i_vx_vy(uint16_t opcode)
+{
+    uint8_t x = X(opcode);
+    uint8_t y = Y(opcode);
+    LOG("Called LD [I], Vx - Vy (V%d, V%d)\n", x, y);
+
+    int8_t step = (x <= y) ? 1 : -1;
+    for (uint8_t idx = 0, reg = x;; idx++, reg = (uint8_t)(reg + step)) {
+        RAM[(uint16_t)(I + idx)] = V[reg];
+        if (reg == y) {
+            break;
+        }
+    }
+}
+
+// 5xy3 - LD Vx - Vy, [I]
+// Read registers Vx through Vy from memory starting at location I, without changing I (XO-CHIP). x may be above y.
+void op_ld_vx_vy_i(uint16_t opcode)
+{
+    uint8_t x = X(opcode);
+    uint8_t y = Y(opcode);
+    LOG("Called LD Vx - Vy, [I] (V%d, V%d)\n", x, y);
+
+    int8_t step = (x <= y) ? 1 : -1;
+    for (uint8_t idx = 0, reg = x;; idx++, reg = (uint8_t)(reg + step)) {
+        V[reg] = RAM[(uint16_t)(I + idx)];
+        if (reg == y) {
+            break;
+        }
+    }
+}
+
+// F000 nnnn - LD I, long addr
+// Set I to the 16 bit address in the next two bytes, then skip them (XO-CHIP).
+void op_ld_i_long(uint16_t opcode)
+{
+    UNUSED(opcode);
+    I = (uint16_t)((RAM[PC] << 8U) | RAM[(uint16_t)(PC + 1)]);
+    LOG("Called LD I, long addr (%04x)\n", I);
+    PC += 2;
+}
+
+// Fn01 - PLANE n
+// Select the bit planes that drawing, clearing and scrolling act on (XO-CHIP).
+void op_plane(uint16_t opcode)
+{
+    LOG("Called PLANE (%d)\n", X(opcode));
+    plane_mask = X(opcode) & 0x3;
+}
+
+// F002 - AUDIO
+// Load the 16 byte audio pattern buffer from I (XO-CHIP).
+void op_audio(uint16_t opcode)
+{
+    LOG("Called AUDIO\n");
+    UNUSED(opcode);
+
+    for (uint8_t idx = 0; idx < sizeof(audio_pattern); idx++) {
+        audio_pattern[idx] = RAM[(uint16_t)(I + idx)];
     }
 }
 
+// Fx30 - LD HF, Vx
+// Set I = location of the 8x10 sprite for digit Vx.
+void op_ld_hf_vx(uint16_t opcode)
+{
+    uint8_t x = X(opcode);
+    LOG("Called LD HF, Vx (V%d)\n", x);
+    I = (uint16_t)(BIG_FONT_BASE_ADDR + ((V[x] & 0xF) * 10));
+}
+
+// Fx3A - PITCH Vx
+// Set the audio pattern playback rate (XO-CHIP).
+void op_pitch(uint16_t opcode)
+{
+    uint8_t x = X(opcode);
+    LOG("Called PITCH Vx (V%d)\n", x);
+    pitch = V[x];
+}
+
+// Fx75 - LD R, Vx
+// Store V0 through Vx in the HP48 flag registers.
+void op_ld_r_vx(uint16_t opcode)
+{
+    uint8_t x = X(opcode);
+    LOG("Called LD R, Vx (V%d)\n", x);
+    memcpy(rpl, V, x + 1);
+}
+
+// Fx85 - LD Vx, R
+// Read V0 through Vx from the HP48 flag registers.
+void op_ld_vx_r(uint16_t opcode)
+{
+    uint8_t x = X(opcode);
+    LOG("Called LD Vx, R (V%d)\n", x);
+    memcpy(V, rpl, x + 1);
+}
+
 #pragma endregion
 #pragma region Handling
 
 typedef void (*OpcodeFunc)(uint16_t);
 OpcodeFunc main_table[16];
 
+void op_unknown(uint16_t opcode)
+{
+    printf("ERROR: Unknown opcode 0x%04x at 0x%04x\n", opcode, PC - 2);
+    cpu_fault = true;
+}
+
 void op_0xxx_handler(uint16_t opcode)
 {
+    if (!has_extension(QUIRKS_SCHIP) && opcode != 0x00E0 && opcode != 0x00EE) {
+        op_sys(opcode);
+        return;
+    }
+
+    if ((opcode & 0xFFF0) == 0x00C0) {
+        op_scd(opcode);
+        return;
+    }
+
+    if ((opcode & 0xFFF0) == 0x00D0 && has_extension(QUIRKS_XOCHIP)) {
+        op_scu(opcode);
+        return;
+    }
+
     switch (opcode) {
     case 0x00E0:
         op_cls(opcode);
@@ -580,12 +1170,45 @@ void op_0xxx_handler(uint16_t opcode)
     case 0x00EE:
         op_ret(opcode);
         break;
+    case 0x00FB:
+        op_scr(opcode);
+        break;
+    case 0x00FC:
+        op_scl(opcode);
+        break;
+    case 0x00FD:
+        op_exit(opcode);
+        break;
+    case 0x00FE:
+    case 0x00FF:
+        op_resolution(opcode);
+        break;
     default:
         op_sys(opcode);
         break;
     }
 }
 
+void op_5xxx_handler(uint16_t opcode)
+{
+    if (!has_extension(QUIRKS_XOCHIP)) {
+        op_se_vx_vy(opcode);
+        return;
+    }
+
+    switch (opcode & 0x000F) {
+    case 0x2:
+        op_ld_i_vx_vy(opcode);
+        break;
+    case 0x3:
+        op_ld_vx_vy_i(opcode);
+        break;
+    default:
+        op_se_vx_vy(opcode);
+        break;
+    }
+}
+
 void op_8xxx_handler(uint16_t opcode)
 {
     switch (opcode & 0x000F) {
@@ -617,8 +1240,7 @@ void op_8xxx_handler(uint16_t opcode)
         op_shl(opcode);
         break;
     default:
-        printf("Unknown opcode 0x%04x\n", opcode);
-        assert(false);
+        op_unknown(opcode);
     }
 }
 
@@ -632,8 +1254,7 @@ void op_Exxx_handler(uint16_t opcode)
         op_sknp(opcode);
         break;
     default:
-        printf("Unknown opcode 0x%04x\n", opcode);
-        assert(false);
+        op_unknown(opcode);
     }
 }
 
@@ -677,9 +1298,64 @@ void op_Fxxx_handler(uint16_t opcode)
         op_ld_vx_i(opcode);
         break;
 
+    case 0x30:
+        if (has_extension(QUIRKS_SCHIP)) {
+            op_ld_hf_vx(opcode);
+        } else {
+            op_unknown(opcode);
+        }
+        break;
+
+    case 0x3A:
+        if (has_extension(QUIRKS_XOCHIP)) {
+            op_pitch(opcode);
+        } else {
+            op_unknown(opcode);
+        }
+        break;
+
+    case 0x75:
+        if (has_extension(QUIRKS_SCHIP)) {
+            op_ld_r_vx(opcode);
+        } else {
+            op_unknown(opcode);
+        }
+        break;
+
+    case 0x85:
+        if (has_extension(QUIRKS_SCHIP)) {
+            op_ld_vx_r(opcode);
+        } else {
+            op_unknown(opcode);
+        }
+        break;
+
+    case 0x00:
+        if (opcode == 0xF000 && has_extension(QUIRKS_XOCHIP)) {
+            op_ld_i_long(opcode);
+        } else {
+            op_unknown(opcode);
+        }
+        break;
+
+    case 0x01:
+        if (has_extension(QUIRKS_XOCHIP)) {
+            op_plane(opcode);
+        } else {
+            op_unknown(opcode);
+        }
+        break;
+
+    case 0x02:
+        if (opcode == 0xF002 && has_extension(QUIRKS_XOCHIP)) {
+            op_audio(opcode);
+        } else {
+            op_unknown(opcode);
+        }
+        break;
+
     default:
-        printf("Unknown opcode 0x%04x\n", opcode);
-        assert(false);
+        op_unknown(opcode);
     }
 }
 
@@ -689,7 +1365,7 @@ OpcodeFunc main_table[16] = {
     op_call,         // 0x2xxx
     op_se_vx_byte,   // 0x3xxx
     op_sne_vx_byte,  // 0x4xxx
-    op_se_vx_vy,     // 0x5xxx
+    op_5xxx_handler, // 0x5xxx
     op_ld_vx_byte,   // 0x6xxx
     op_add_vx_byte,  // 0x7xxx
     op_8xxx_handler, // 0x8xxx
@@ -709,59 +1385,2193 @@ void handle_opcode(uint16_t opcode)
     main_table[category](opcode);
 }
 
-#pragma endregion
-#pragma region Drawing
-
-void draw_pixel(uint16_t x, uint16_t y, bool enable)
+// Fetch, decode and execute one opcode. Returns false once the machine has faulted.
+bool cpu_step(void)
 {
-    assert(x <= WIDTH);
-    assert(y <= HEIGHT);
+    if ((uint32_t)PC + 1 >= ram_size) {
+        printf("ERROR: Program counter 0x%04x above RAM size 0x%04x\n", PC + 1, ram_size);
+        cpu_fault = true;
+        return false;
+    }
 
-    Color color = enable ? BLACK : WHITE;
-    DrawRectangle(x * SCALE, y * SCALE, SCALE, SCALE, color);
+    uint16_t opcode = (uint16_t)((RAM[PC] << 8U) | RAM[PC + 1]);
+    LOG("Opcode 0x%04x, PC 0x%04x\n", opcode, PC);
+    PC += 2;
+    handle_opcode(opcode);
+    return !cpu_fault;
 }
 
-void draw_screen(void)
+// DT and ST count down once per frame
+void tick_timers(void)
 {
-    for (uint16_t x = 0; x < WIDTH; x++) {
-        for (uint16_t y = 0; y < HEIGHT; y++) {
-            draw_pixel(x, y, framebuffer[y][x]);
-        }
+    if (DT > 0) {
+        DT--;
+    }
+
+    if (ST > 0) {
+        ST--;
     }
 }
 
-int copy_program_into_RAM(void)
+// Run up to steps opcodes, stopping early if the machine can't continue
+bool cpu_run(int steps)
 {
-    FILE *f = fopen(FILENAME, "rb");
-    if (!f) {
-        return -1;
+    for (int step = 0; step < steps; step++) {
+        if (!cpu_step()) {
+            return false;
+        }
     }
+    return true;
+}
 
-    fseek(f, 0, SEEK_END);
-    long file_size = ftell(f);
-    rewind(f);
+bool debug_run(int steps);
 
-    if (file_size < 0 || (size_t)file_size > PROGRAM_REGION_SIZE) {
-        fclose(f);
-        return -1;
-    }
+// What the main loop calls each frame. The debugger swaps in debug_run only while something is armed, so without breakpoints nothing is checked per opcode.
+bool (*run_steps)(int steps) = cpu_run;
 
-    size_t bytes_read = fread(RAM + PROGRAM_BASE_ADDR, 1, (size_t)file_size, f);
+#pragma endregion
+#pragma region Debugger
 
-    fclose(f);
+typedef struct {
+    uint16_t address;
+    uint16_t length;
+} RamWatch;
 
-    return (bytes_read == (size_t)file_size) ? 0 : -1;
+typedef struct {
+    uint8_t breakpoints[XO_RAM_SIZE / 8]; // One bit per address
+    uint32_t breakpoint_count;
+    RamWatch ram_watches[DEBUG_MAX_WATCHES];
+    uint8_t ram_watch_count;
+    uint32_t register_watches; // Bits 0-15 watch V0-VF, DEBUG_WATCH_I watches I
+    bool stepping;             // Stop before the next opcode
+    bool step_over;            // Stop once PC is back at step_over_pc with the same stack depth
+    uint16_t step_over_pc;
+    uint16_t step_over_sp;
+    bool hit;                  // A watchpoint fired during the last opcode
+    bool resumed;              // Set by the prompt, cleared once PC leaves resume_pc
+    uint16_t resume_pc;
+    bool quit;
+    char reason[96];
+} Debugger;
+
+Debugger debugger;
+volatile sig_atomic_t debug_interrupted;
+
+bool debug_is_breakpoint(uint16_t address)
+{
+    return debugger.breakpoints[address / 8] & (1 << (address % 8));
+}
+
+void debug_set_breakpoint(uint16_t address, bool enable)
+{
+    if (debug_is_breakpoint(address) == enable) {
+        return;
+    }
+    debugger.breakpoints[address / 8] ^= (uint8_t)(1 << (address % 8));
+    debugger.breakpoint_count = enable ? debugger.breakpoint_count + 1 : debugger.breakpoint_count - 1;
+}
+
+// Writes wrap at the top of the 16 bit address space like the opcodes doing them, so the offsets are compared modulo 0x10000
+void debug_check_write(uint16_t address, uint16_t length)
+{
+    for (uint8_t i = 0; i < debugger.ram_watch_count; i++) {
+        const RamWatch *watch = &debugger.ram_watches[i];
+        uint16_t into         = (uint16_t)(address - watch->address); // Where the write starts inside the watch
+        uint16_t before       = (uint16_t)(watch->address - address); // Where the watch starts inside the write
+        if (into < watch->length || before < length) {
+            debugger.hit = true;
+            snprintf(debugger.reason, sizeof(debugger.reason), "write to 0x%04x-0x%04x hit watchpoint 0x%04x", address, (uint16_t)(address + length - 1), watch->address);
+        }
+    }
+}
+
+// Trapping versions of the handlers that write RAM relative to I. Only in main_table while a RAM watchpoint is set.
+void op_5xxx_watch_handler(uint16_t opcode)
+{
+    if (N(opcode) == 0x2 && has_extension(QUIRKS_XOCHIP)) {
+        uint8_t x = X(opcode);
+        uint8_t y = Y(opcode);
+        debug_check_write(I, (uint16_t)((x <= y ? y - x : x - y) + 1));
+    }
+    op_5xxx_handler(opcode);
+}
+
+void op_Fxxx_watch_handler(uint16_t opcode)
+{
+    switch (KK(opcode)) {
+    case 0x33:
+        debug_check_write(I, 3);
+        break;
+    case 0x55:
+        debug_check_write(I, (uint16_t)(X(opcode) + 1));
+        break;
+    default:
+        break;
+    }
+    op_Fxxx_handler(opcode);
+}
+
+// Put the trapping entry points in place for whatever is armed, and take them out again once nothing is
+void debug_rearm(void)
+{
+    bool armed = debugger.breakpoint_count > 0 || debugger.ram_watch_count > 0 || debugger.register_watches != 0 || debugger.stepping || debugger.step_over;
+
+    run_steps       = armed ? debug_run : cpu_run;
+    main_table[0x5] = debugger.ram_watch_count > 0 ? op_5xxx_watch_handler : op_5xxx_handler;
+    main_table[0xF] = debugger.ram_watch_count > 0 ? op_Fxxx_watch_handler : op_Fxxx_handler;
+}
+
+void debug_print_state(void)
+{
+    uint16_t opcode = (uint16_t)((RAM[PC] << 8U) | RAM[(uint16_t)(PC + 1)]);
+
+    printf("PC 0x%04x: %04x  I 0x%04x  SP %d  DT %d  ST %d\n", PC, opcode, I, stack_ptr, DT, ST);
+    for (uint8_t reg = 0; reg < 16; reg++) {
+        printf("V%X %02x%s", reg, V[reg], reg % 8 == 7 ? "\n" : "  ");
+    }
+}
+
+void debug_print_memory(uint16_t address, uint16_t length)
+{
+    for (uint16_t offset = 0; offset < length; offset++) {
+        if (offset % 16 == 0) {
+            printf("%s0x%04x:", offset ? "\n" : "", (uint16_t)(address + offset));
+        }
+        printf(" %02x", RAM[(uint16_t)(address + offset)]);
+    }
+    printf("\n");
+}
+
+// Read commands from stdin until one of them resumes execution
+void debug_prompt(void)
+{
+    if (debugger.reason[0] != '\0') {
+        printf("Stopped: %s\n", debugger.reason);
+        debugger.reason[0] = '\0';
+    }
+    debug_print_state();
+
+    debugger.stepping  = false;
+    debugger.step_over = false;
+    debugger.hit       = false;
+
+    char line[128];
+    while (printf("(chip8) "), fflush(stdout), fgets(line, sizeof(line), stdin)) {
+        char command[8]  = {0};
+        char arg[16]     = {0};
+        unsigned long n  = 1;
+        int fields       = sscanf(line, "%7s %15s %lx", command, arg, &n);
+        unsigned long at = (fields >= 2) ? strtoul(arg, NULL, 16) & 0xFFFF : PC;
+
+        if (fields < 1 || strcmp(command, "c") == 0) {
+            break;
+        } else if (strcmp(command, "s") == 0) {
+            debugger.stepping = true;
+            break;
+        } else if (strcmp(command, "n") == 0) {
+            uint16_t opcode = (uint16_t)((RAM[PC] << 8U) | RAM[(uint16_t)(PC + 1)]);
+            if ((opcode & 0xF000) == 0x2000) {
+                debugger.step_over    = true;
+                debugger.step_over_pc = (uint16_t)(PC + 2);
+                debugger.step_over_sp = stack_ptr;
+            } else {
+                debugger.stepping = true;
+            }
+            break;
+        } else if (strcmp(command, "b") == 0 || strcmp(command, "d") == 0) {
+            debug_set_breakpoint((uint16_t)at, command[0] == 'b');
+        } else if (strcmp(command, "w") == 0) {
+            if (debugger.ram_watch_count < DEBUG_MAX_WATCHES) {
+                debugger.ram_watches[debugger.ram_watch_count++] = (RamWatch){(uint16_t)at, (uint16_t)n};
+            }
+        } else if (strcmp(command, "wr") == 0 && fields >= 2) {
+            bool is_i = toupper(arg[0]) == 'I';
+            debugger.register_watches |= is_i ? DEBUG_WATCH_I : (1U << (strtoul(arg + 1, NULL, 16) & 0xF));
+        } else if (strcmp(command, "u") == 0) {
+            debugger.ram_watch_count  = 0;
+            debugger.register_watches = 0;
+        } else if (strcmp(command, "r") == 0) {
+            debug_print_state();
+        } else if (strcmp(command, "m") == 0) {
+            debug_print_memory((uint16_t)at, fields >= 3 ? (uint16_t)n : 16);
+        } else if (strcmp(command, "q") == 0) {
+            debugger.quit = true;
+            break;
+        } else {
+            printf("c continue, s step, n step over CALL, b/d ADDR set/delete breakpoint, w ADDR [LEN] watch RAM writes,\n"
+                   "wr Vx|I watch a register, u remove watchpoints, r registers, m ADDR [LEN] memory, q quit\n");
+        }
+    }
+
+    debugger.resumed   = true;
+    debugger.resume_pc = PC;
+    debug_interrupted  = 0; // A Ctrl-C typed at the prompt doesn't stop the program again
+    debug_rearm();
+}
+
+// Ctrl-C only raises a flag for the main loop. A second one before the loop gets to it falls back to the default and quits.
+void debug_interrupt(int sig)
+{
+    if (debug_interrupted) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+    debug_interrupted = 1;
+}
+
+// Polled once per frame by the main loop, so breaking in costs nothing per opcode
+void debug_break_in(void)
+{
+    debug_interrupted = 0;
+    snprintf(debugger.reason, sizeof(debugger.reason), "interrupted");
+    debugger.stepping = true;
+    debug_rearm();
+}
+
+bool debug_should_stop(void)
+{
+    if (debugger.hit || debugger.stepping) {
+        return true;
+    }
+
+    if (debugger.step_over && PC == debugger.step_over_pc && stack_ptr == debugger.step_over_sp) {
+        snprintf(debugger.reason, sizeof(debugger.reason), "stepped over CALL");
+        return true;
+    }
+
+    // Fx0A rewinds PC until a key is down, so a breakpoint on it would otherwise stop again on every retry
+    if (debugger.resumed && PC == debugger.resume_pc) {
+        return false;
+    }
+    debugger.resumed = false;
+
+    if (debug_is_breakpoint(PC)) {
+        snprintf(debugger.reason, sizeof(debugger.reason), "breakpoint 0x%04x", PC);
+        return true;
+    }
+    return false;
+}
+
+// cpu_run with breakpoints, stepping and register watchpoints checked around every opcode.
+// The prompt always comes before an opcode and that opcode runs when it returns, so continuing from a breakpoint doesn't stop on it again
+// (debug_should_stop covers an Fx0A that keeps re-running in place).
+bool debug_run(int steps)
+{
+    for (int step = 0; step < steps; step++) {
+        if (debug_should_stop()) {
+            debug_prompt();
+            if (debugger.quit) {
+                return false;
+            }
+        }
+
+        uint8_t old_V[16];
+        memcpy(old_V, V, sizeof(old_V));
+        uint16_t old_I = I;
+
+        if (!cpu_step()) {
+            return false;
+        }
+
+        for (uint8_t reg = 0; reg < 16; reg++) {
+            if ((debugger.register_watches & (1U << reg)) && V[reg] != old_V[reg]) {
+                debugger.hit = true;
+                snprintf(debugger.reason, sizeof(debugger.reason), "V%X changed 0x%02x -> 0x%02x", reg, old_V[reg], V[reg]);
+            }
+        }
+        if ((debugger.register_watches & DEBUG_WATCH_I) && I != old_I) {
+            debugger.hit = true;
+            snprintf(debugger.reason, sizeof(debugger.reason), "I changed 0x%04x -> 0x%04x", old_I, I);
+        }
+    }
+    return true;
+}
+
+#pragma endregion
+#pragma region ROM catalog
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define FNV1A_INIT   0xcbf29ce484222325ULL
+#define FNV1A_PRIME  0x00000100000001b3ULL
+#define ROM_SIZE_MAX (XO_RAM_SIZE - PROGRAM_BASE_ADDR) // Largest ROM any supported mode can load
+
+uint64_t time_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// 64-bit FNV-1a, pass FNV1A_INIT to start a new hash or a previous result to continue one
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= FNV1A_PRIME;
+    }
+    return hash;
+}
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+} MappedFile;
+
+// Map a whole file read-only. Where mmap isn't available the file is read into a heap buffer instead.
+int map_file(const char *path, MappedFile *file)
+{
+    file->data = NULL;
+    file->size = 0;
+
+    int fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 0) {
+        close(fd);
+        return -1;
+    }
+
+    file->size = (size_t)st.st_size;
+    if (file->size == 0) {
+        close(fd);
+        return 0;
+    }
+
+#ifndef _WIN32
+    void *data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+#else
+    void *data       = malloc(file->size);
+    size_t remaining = data ? file->size : 0;
+    while (remaining > 0) {
+        int bytes_read = read(fd, (uint8_t *)data + (file->size - remaining), (unsigned)remaining);
+        if (bytes_read <= 0) {
+            break;
+        }
+        remaining -= (size_t)bytes_read;
+    }
+    close(fd);
+    if (!data || remaining > 0) {
+        free(data);
+        return -1;
+    }
+#endif
+
+    file->data = data;
+    return 0;
+}
+
+void unmap_file(MappedFile *file)
+{
+    if (file->data) {
+#ifndef _WIN32
+        munmap((void *)file->data, file->size);
+#else
+        free((void *)file->data);
+#endif
+    }
+    file->data = NULL;
+    file->size = 0;
+}
+
+typedef enum {
+    OPCLASS_CHIP8,
+    OPCLASS_SCHIP,
+    OPCLASS_XOCHIP,
+    OPCLASS_UNKNOWN,
+} OpcodeClass;
+
+// Which instruction set an opcode belongs to, so a ROM can be matched to the mode it needs
+OpcodeClass classify_opcode(uint16_t opcode)
+{
+    uint8_t n  = N(opcode);
+    uint8_t kk = KK(opcode);
+
+    switch (opcode >> 12) {
+    case 0x0:
+        if ((opcode & 0xFFF0) == 0x00C0 || (opcode >= 0x00FB && opcode <= 0x00FF)) {
+            return OPCLASS_SCHIP;
+        }
+        if ((opcode & 0xFFF0) == 0x00D0) {
+            return OPCLASS_XOCHIP;
+        }
+        return OPCLASS_CHIP8; // CLS, RET and the legacy SYS addr
+    case 0x5:
+        if (n == 0x0) {
+            return OPCLASS_CHIP8;
+        }
+        return (n == 0x2 || n == 0x3) ? OPCLASS_XOCHIP : OPCLASS_UNKNOWN;
+    case 0x8:
+        return (n <= 0x7 || n == 0xE) ? OPCLASS_CHIP8 : OPCLASS_UNKNOWN;
+    case 0x9:
+        return (n == 0x0) ? OPCLASS_CHIP8 : OPCLASS_UNKNOWN;
+    case 0xD:
+        return (n == 0x0) ? OPCLASS_SCHIP : OPCLASS_CHIP8;
+    case 0xE:
+        return (kk == 0x9E || kk == 0xA1) ? OPCLASS_CHIP8 : OPCLASS_UNKNOWN;
+    case 0xF:
+        switch (kk) {
+        case 0x07:
+        case 0x0A:
+        case 0x15:
+        case 0x18:
+        case 0x1E:
+        case 0x29:
+        case 0x33:
+        case 0x55:
+        case 0x65:
+            return OPCLASS_CHIP8;
+        case 0x30:
+        case 0x75:
+        case 0x85:
+            return OPCLASS_SCHIP;
+        case 0x3A:
+            return OPCLASS_XOCHIP;
+        case 0x00:
+            return (opcode == 0xF000) ? OPCLASS_XOCHIP : OPCLASS_UNKNOWN;
+        case 0x01:
+            return (X(opcode) <= 0x3) ? OPCLASS_XOCHIP : OPCLASS_UNKNOWN;
+        case 0x02:
+            return (opcode == 0xF002) ? OPCLASS_XOCHIP : OPCLASS_UNKNOWN;
+        default:
+            return OPCLASS_UNKNOWN;
+        }
+    default:
+        return OPCLASS_CHIP8;
+    }
+}
+
+typedef struct {
+    uint16_t reachable; // Instructions reachable from PROGRAM_BASE_ADDR
+    uint16_t unknown;   // Reachable words that don't decode to any instruction
+    uint16_t schip;     // Reachable SUPER-CHIP instructions
+    uint16_t xochip;    // Reachable XO-CHIP instructions
+    uint16_t indirect;  // Bnnn jumps, where the walk has to give up
+} RomAnalysis;
+
+void analysis_visit(uint8_t *visited, uint16_t *pending, size_t *pending_count, size_t rom_size, size_t offset)
+{
+    if (offset < rom_size - 1 && !visited[offset]) {
+        visited[offset]            = 1;
+        pending[(*pending_count)++] = (uint16_t)offset;
+    }
+}
+
+// Walk the control flow from the entry point, so sprite data mixed in with the code isn't mistaken for instructions
+RomAnalysis analyse_rom(const uint8_t *rom, size_t size)
+{
+    RomAnalysis analysis = {0};
+    if (size < 2) {
+        return analysis;
+    }
+
+    uint8_t *visited  = calloc(size + 1, 1);
+    uint16_t *pending = malloc((size + 1) * sizeof(uint16_t));
+    size_t count      = 0;
+    if (!visited || !pending) {
+        free(visited);
+        free(pending);
+        return analysis;
+    }
+
+    analysis_visit(visited, pending, &count, size, 0);
+
+    while (count > 0) {
+        size_t offset   = pending[--count];
+        uint16_t opcode = (uint16_t)((rom[offset] << 8U) | rom[offset + 1]);
+        size_t target   = (NNN(opcode) >= PROGRAM_BASE_ADDR) ? (size_t)(NNN(opcode) - PROGRAM_BASE_ADDR) : SIZE_MAX;
+
+        analysis.reachable++;
+
+        switch (classify_opcode(opcode)) {
+        case OPCLASS_SCHIP:
+            analysis.schip++;
+            break;
+        case OPCLASS_XOCHIP:
+            analysis.xochip++;
+            break;
+        case OPCLASS_UNKNOWN:
+            analysis.unknown++;
+            continue;
+        default:
+            break;
+        }
+
+        switch (opcode >> 12) {
+        case 0x0:
+            if (opcode != 0x00EE && opcode != 0x00FD) {
+                analysis_visit(visited, pending, &count, size, offset + 2);
+            }
+            break;
+        case 0x1:
+            analysis_visit(visited, pending, &count, size, target);
+            break;
+        case 0x2:
+            analysis_visit(visited, pending, &count, size, target);
+            analysis_visit(visited, pending, &count, size, offset + 2);
+            break;
+        case 0x3:
+        case 0x4:
+        case 0x5:
+        case 0x9:
+        case 0xE:
+            analysis_visit(visited, pending, &count, size, offset + 2);
+            analysis_visit(visited, pending, &count, size, offset + 4);
+            break;
+        case 0xB:
+            analysis.indirect++;
+            break;
+        default:
+            analysis_visit(visited, pending, &count, size, offset + ((opcode == 0xF000) ? 4 : 2));
+            break;
+        }
+    }
+
+    free(visited);
+    free(pending);
+    return analysis;
+}
+
+QuirkProfile guess_quirks(const RomAnalysis *analysis)
+{
+    if (analysis->xochip > 0) {
+        return QUIRKS_XOCHIP;
+    }
+    if (analysis->schip > 0) {
+        return QUIRKS_SCHIP;
+    }
+    return QUIRKS_CHIP8;
+}
+
+typedef struct {
+    char name[ROM_PATH_MAX];        // File name inside the catalogued directory, so every spelling of the directory finds the same entry
+    uint64_t hash;                  // FNV-1a of the ROM contents
+    int64_t mtime_ns;               // Modification time and size decide whether the cached fields are stale
+    uint32_t size;
+    uint8_t quirks;                 // QuirkProfile
+    RomAnalysis analysis;
+    uint64_t good_framebuffer_hash; // Last framebuffer hash the ROM was known to be correct with, 0 if never checked
+} RomEntry;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;
+    uint32_t count;
+    uint32_t reserved;
+} CatalogHeader;
+
+// The on-disk index is just the header followed by the raw entries, it's a cache so a mismatched layout is rebuilt rather than converted
+typedef struct {
+    char index_path[ROM_PATH_MAX + sizeof(CATALOG_FILENAME)];
+    char dir[ROM_PATH_MAX]; // Canonical path of the catalogued directory, empty if it couldn't be resolved
+    RomEntry *entries;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *by_hash; // Open addressed tables of indices into entries, CATALOG_EMPTY marks a free slot
+    uint32_t *by_name;
+    uint32_t slots;    // Always a power of two
+} RomCatalog;
+
+void catalog_free(RomCatalog *catalog)
+{
+    free(catalog->entries);
+    free(catalog->by_hash);
+    free(catalog->by_name);
+    memset(catalog, 0, sizeof(*catalog));
+}
+
+uint64_t name_hash(const char *name)
+{
+    return fnv1a(FNV1A_INIT, name, strlen(name));
+}
+
+// Resolve ., .., repeated slashes and symlinks so different spellings of a directory compare equal. The result is malloced.
+char *canonical_path(const char *path)
+{
+#ifndef _WIN32
+    return realpath(path, NULL);
+#else
+    return _fullpath(NULL, path, 0);
+#endif
+}
+
+int64_t mtime_ns(const struct stat *st)
+{
+#if defined(__APPLE__)
+    return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    return (int64_t)st->st_mtime * 1000000000;
+#else
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+void catalog_reindex(RomCatalog *catalog)
+{
+    uint32_t slots = 16;
+    while (slots < catalog->count * 2) {
+        slots *= 2;
+    }
+
+    free(catalog->by_hash);
+    free(catalog->by_name);
+    catalog->slots   = slots;
+    catalog->by_hash = malloc(slots * sizeof(uint32_t));
+    catalog->by_name = malloc(slots * sizeof(uint32_t));
+    memset(catalog->by_hash, 0xFF, slots * sizeof(uint32_t));
+    memset(catalog->by_name, 0xFF, slots * sizeof(uint32_t));
+
+    uint32_t mask = slots - 1;
+    for (uint32_t i = 0; i < catalog->count; i++) {
+        uint32_t slot = (uint32_t)catalog->entries[i].hash & mask;
+        while (catalog->by_hash[slot] != CATALOG_EMPTY) {
+            slot = (slot + 1) & mask;
+        }
+        catalog->by_hash[slot] = i;
+
+        slot = (uint32_t)name_hash(catalog->entries[i].name) & mask;
+        while (catalog->by_name[slot] != CATALOG_EMPTY) {
+            slot = (slot + 1) & mask;
+        }
+        catalog->by_name[slot] = i;
+    }
+}
+
+RomEntry *catalog_find_hash(const RomCatalog *catalog, uint64_t hash)
+{
+    if (catalog->slots == 0) {
+        return NULL;
+    }
+
+    uint32_t mask = catalog->slots - 1;
+    for (uint32_t slot = (uint32_t)hash & mask; catalog->by_hash[slot] != CATALOG_EMPTY; slot = (slot + 1) & mask) {
+        RomEntry *entry = &catalog->entries[catalog->by_hash[slot]];
+        if (entry->hash == hash) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+RomEntry *catalog_find_name(const RomCatalog *catalog, const char *name)
+{
+    if (catalog->slots == 0) {
+        return NULL;
+    }
+
+    uint32_t mask = catalog->slots - 1;
+    for (uint32_t slot = (uint32_t)name_hash(name) & mask; catalog->by_name[slot] != CATALOG_EMPTY; slot = (slot + 1) & mask) {
+        RomEntry *entry = &catalog->entries[catalog->by_name[slot]];
+        if (strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Append without reindexing, callers batch up appends and reindex once
+int catalog_append(RomCatalog *catalog, const RomEntry *entry)
+{
+    if (catalog->count == catalog->capacity) {
+        uint32_t capacity = catalog->capacity ? catalog->capacity * 2 : 64;
+        RomEntry *entries = realloc(catalog->entries, capacity * sizeof(RomEntry));
+        if (!entries) {
+            return -1;
+        }
+        catalog->entries  = entries;
+        catalog->capacity = capacity;
+    }
+    catalog->entries[catalog->count++] = *entry;
+    return 0;
+}
+
+int catalog_save(const RomCatalog *catalog)
+{
+    FILE *f = fopen(catalog->index_path, "wb");
+    if (!f) {
+        return -1;
+    }
+
+    CatalogHeader header = {
+        .magic      = CATALOG_MAGIC,
+        .version    = CATALOG_VERSION,
+        .entry_size = (uint16_t)sizeof(RomEntry),
+        .count      = catalog->count,
+    };
+
+    size_t written = fwrite(&header, sizeof(header), 1, f);
+    written += fwrite(catalog->entries, sizeof(RomEntry), catalog->count, f);
+
+    return (fclose(f) == 0 && written == catalog->count + 1) ? 0 : -1;
+}
+
+// Load the index stored in dir. A missing or stale index leaves an empty catalog that will be saved back to the same place.
+int catalog_load(RomCatalog *catalog, const char *dir)
+{
+    catalog_free(catalog);
+    snprintf(catalog->index_path, sizeof(catalog->index_path), "%s/%s", dir, CATALOG_FILENAME);
+
+    char *canonical = canonical_path(dir);
+    if (canonical && strlen(canonical) < sizeof(catalog->dir)) {
+        memcpy(catalog->dir, canonical, strlen(canonical) + 1);
+    }
+    free(canonical);
+
+    MappedFile index;
+    if (map_file(catalog->index_path, &index) != 0) {
+        catalog_reindex(catalog);
+        return -1;
+    }
+
+    const CatalogHeader *header = (const CatalogHeader *)index.data;
+    int result                  = -1;
+    if (index.size >= sizeof(CatalogHeader) && header->magic == CATALOG_MAGIC && header->version == CATALOG_VERSION && header->entry_size == sizeof(RomEntry) &&
+        index.size == sizeof(CatalogHeader) + (size_t)header->count * sizeof(RomEntry)) {
+        catalog->entries = malloc(((size_t)header->count + 1) * sizeof(RomEntry));
+        if (catalog->entries) {
+            memcpy(catalog->entries, index.data + sizeof(CatalogHeader), (size_t)header->count * sizeof(RomEntry));
+            catalog->count    = header->count;
+            catalog->capacity = header->count + 1;
+            result            = 0;
+        }
+    }
+
+    unmap_file(&index);
+    catalog_reindex(catalog);
+    return result;
+}
+
+// The name path is catalogued under, or NULL when path isn't in the catalog's directory
+const char *catalog_name(const RomCatalog *catalog, const char *path)
+{
+    char dir[ROM_PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash      = strrchr(dir, '/');
+    const char *name = slash ? path + (slash - dir) + 1 : path;
+    if (slash) {
+        *slash = '\0';
+    } else {
+        snprintf(dir, sizeof(dir), ".");
+    }
+
+    if (catalog->dir[0] == '\0' || name[0] == '\0') {
+        return NULL;
+    }
+
+    char *canonical = canonical_path(slash == dir ? "/" : dir);
+    bool same       = canonical && strcmp(canonical, catalog->dir) == 0;
+    free(canonical);
+    return same ? name : NULL;
+}
+
+// Fill in entry for the ROM at path, catalogued as name. When known already holds the same contents (a copy, or a file that was only
+// touched) its analysis is reused instead of walking the ROM again. Returns 1 if it was reused, 0 if the ROM was analysed.
+int describe_rom(RomEntry *entry, const char *path, const char *name, const MappedFile *rom, const RomCatalog *known)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || rom->size > ROM_SIZE_MAX) {
+        return -1;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    entry->hash     = fnv1a(FNV1A_INIT, rom->data, rom->size);
+    entry->mtime_ns = mtime_ns(&st);
+    entry->size     = (uint32_t)rom->size;
+
+    const RomEntry *same = catalog_find_hash(known, entry->hash);
+    if (same && same->size == entry->size) {
+        entry->analysis              = same->analysis;
+        entry->quirks                = same->quirks;
+        entry->good_framebuffer_hash = same->good_framebuffer_hash;
+        return 1;
+    }
+
+    entry->analysis = analyse_rom(rom->data, rom->size);
+    entry->quirks   = (uint8_t)guess_quirks(&entry->analysis);
+    return 0;
+}
+
+bool is_fresh(const RomEntry *entry, const struct stat *st)
+{
+    return entry && entry->mtime_ns == mtime_ns(st) && entry->size == (uint64_t)st->st_size;
+}
+
+bool is_rom_filename(const char *name)
+{
+    if (name[0] == '.') {
+        return false;
+    }
+
+    const char *ext = strrchr(name, '.');
+    if (!ext) {
+        return true; // Bare names like SCTEST
+    }
+    return strcasecmp(ext, ".ch8") == 0 || strcasecmp(ext, ".sc8") == 0 || strcasecmp(ext, ".xo8") == 0;
+}
+
+// Bring the catalog of dir up to date. ROMs whose size and mtime match the stored index are neither read nor analysed again, and changed or
+// new ROMs whose content hash is already in the index are only read.
+int catalog_scan(RomCatalog *catalog, const char *dir)
+{
+    uint64_t start = time_now_ns();
+
+    RomCatalog previous = {0};
+    catalog_load(&previous, dir);
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        catalog_free(&previous);
+        return -1;
+    }
+
+    catalog_free(catalog);
+    memcpy(catalog->index_path, previous.index_path, sizeof(catalog->index_path));
+    memcpy(catalog->dir, previous.dir, sizeof(catalog->dir));
+
+    uint32_t analysed = 0;
+    uint32_t matched  = 0;
+    struct dirent *dirent;
+    while ((dirent = readdir(d)) != NULL) {
+        if (!is_rom_filename(dirent->d_name)) {
+            continue;
+        }
+
+        char path[ROM_PATH_MAX];
+        if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir, dirent->d_name) >= sizeof(path)) {
+            continue;
+        }
+
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > ROM_SIZE_MAX) {
+            continue;
+        }
+
+        RomEntry entry;
+        const RomEntry *cached = catalog_find_name(&previous, dirent->d_name);
+        if (is_fresh(cached, &st)) {
+            entry = *cached;
+        } else {
+            MappedFile rom;
+            if (map_file(path, &rom) != 0) {
+                continue;
+            }
+            int result = describe_rom(&entry, path, dirent->d_name, &rom, &previous);
+            unmap_file(&rom);
+            if (result < 0) {
+                continue;
+            }
+            if (result == 1) {
+                matched++;
+            } else {
+                analysed++;
+            }
+        }
+
+        if (catalog_append(catalog, &entry) != 0) {
+            break;
+        }
+    }
+    closedir(d);
+
+    bool dirty = analysed > 0 || matched > 0 || catalog->count != previous.count;
+    catalog_free(&previous);
+    catalog_reindex(catalog);
+
+    if (dirty && catalog_save(catalog) != 0) {
+        printf("WARNING: Failed to write %s\n", catalog->index_path);
+    }
+
+    printf("NOTE: Catalog %s has %u ROMs, analysed %u, matched %u by content hash, took %.2f ms\n", dir, catalog->count, analysed, matched,
+        (double)(time_now_ns() - start) / 1e6);
+    return 0;
+}
+
+// Metadata for the ROM at path, taken from the catalog when it's still fresh. Anything analysed here is added to the catalog so the next launch can skip it.
+// ROMs outside the catalog's directory are only matched by content hash and never added.
+RomEntry lookup_rom(RomCatalog *catalog, const char *path, const MappedFile *rom)
+{
+    RomEntry entry   = {0};
+    const char *name = catalog_name(catalog, path);
+
+    struct stat st;
+    if (name && stat(path, &st) == 0) {
+        const RomEntry *cached = catalog_find_name(catalog, name);
+        if (is_fresh(cached, &st)) {
+            return *cached;
+        }
+    }
+
+    const char *slash = strrchr(path, '/');
+    if (describe_rom(&entry, path, name ? name : (slash ? slash + 1 : path), rom, catalog) < 0) {
+        return entry;
+    }
+
+    if (!name || catalog->index_path[0] == '\0') {
+        return entry;
+    }
+
+    RomEntry *stale = catalog_find_name(catalog, name);
+    if (stale) {
+        *stale = entry;
+    } else if (catalog_append(catalog, &entry) != 0) {
+        return entry;
+    }
+    catalog_reindex(catalog);
+
+    if (catalog_save(catalog) != 0) {
+        printf("WARNING: Failed to write %s\n", catalog->index_path);
+    }
+    return entry;
+}
+
+#pragma endregion
+#pragma region Tracing
+
+static const char *trace_counter_names[TRACE_COUNTERS] = {"instructions", "branch_misses", "cache_misses"};
+
+typedef struct {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint64_t counters[TRACE_COUNTERS]; // Deltas over the span, all zero without --perf
+} TraceEvent;
+
+// One per thread so recording a span never takes a lock
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;
+    uint32_t tid;
+    int perf_fds[TRACE_COUNTERS]; // perf_fds[0] leads the counter group, -1 when counters are off
+    uint64_t written;             // Spans recorded so far, only the last TRACE_CAPACITY are kept
+    TraceEvent events[TRACE_CAPACITY];
+} TraceBuffer;
+
+typedef struct {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t counters[TRACE_COUNTERS];
+} TraceSpan;
+
+bool trace_enabled;
+bool trace_perf_counters;
+uint64_t trace_epoch_ns;
+
+static _Atomic(TraceBuffer *) trace_buffers;
+static atomic_uint trace_next_tid;
+static _Thread_local TraceBuffer *trace_buffer;
+
+#ifdef __linux__
+int perf_open(uint64_t config, int group_fd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = config;
+    attr.read_format    = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#endif
+
+// Hardware counters for the calling thread. Falls back to timing only when perf_event_open isn't allowed.
+void trace_open_counters(TraceBuffer *buffer)
+{
+    for (size_t i = 0; i < TRACE_COUNTERS; i++) {
+        buffer->perf_fds[i] = -1;
+    }
+
+#ifdef __linux__
+    static const uint64_t configs[TRACE_COUNTERS] = {PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES};
+
+    for (size_t i = 0; i < TRACE_COUNTERS; i++) {
+        buffer->perf_fds[i] = perf_open(configs[i], buffer->perf_fds[0]);
+        if (buffer->perf_fds[i] < 0) {
+            printf("WARNING: perf_event_open failed, tracing without hardware counters\n");
+            for (size_t j = 0; j < i; j++) {
+                close(buffer->perf_fds[j]);
+                buffer->perf_fds[j] = -1;
+            }
+            return;
+        }
+    }
+#endif
+}
+
+void trace_read_counters(const TraceBuffer *buffer, uint64_t counters[TRACE_COUNTERS])
+{
+    uint64_t values[1 + TRACE_COUNTERS]; // PERF_FORMAT_GROUP puts the number of counters first
+
+    if (buffer->perf_fds[0] < 0 || read(buffer->perf_fds[0], values, sizeof(values)) != (ssize_t)sizeof(values)) {
+        memset(counters, 0, TRACE_COUNTERS * sizeof(uint64_t));
+        return;
+    }
+    memcpy(counters, values + 1, TRACE_COUNTERS * sizeof(uint64_t));
+}
+
+TraceBuffer *trace_thread_buffer(void)
+{
+    if (trace_buffer) {
+        return trace_buffer;
+    }
+
+    TraceBuffer *buffer = calloc(1, sizeof(TraceBuffer));
+    if (!buffer) {
+        return NULL;
+    }
+
+    buffer->tid = atomic_fetch_add(&trace_next_tid, 1) + 1;
+    if (trace_perf_counters) {
+        trace_open_counters(buffer);
+    } else {
+        memset(buffer->perf_fds, 0xFF, sizeof(buffer->perf_fds));
+    }
+
+    buffer->next = atomic_load(&trace_buffers);
+    while (!atomic_compare_exchange_weak(&trace_buffers, &buffer->next, buffer)) {
+    }
+
+    trace_buffer = buffer;
+    return buffer;
+}
+
+void trace_start(bool perf_counters)
+{
+    trace_enabled       = true;
+    trace_perf_counters = perf_counters;
+    trace_epoch_ns      = time_now_ns();
+}
+
+TraceSpan trace_begin(const char *name)
+{
+    TraceSpan span = {.name = name};
+    if (!trace_enabled) {
+        return span;
+    }
+
+    TraceBuffer *buffer = trace_thread_buffer();
+    if (buffer) {
+        trace_read_counters(buffer, span.counters);
+    }
+    span.start_ns = time_now_ns();
+    return span;
+}
+
+void trace_end(const TraceSpan *span)
+{
+    if (!trace_enabled || !trace_buffer) {
+        return;
+    }
+
+    uint64_t end_ns = time_now_ns();
+
+    TraceEvent *event  = &trace_buffer->events[trace_buffer->written % TRACE_CAPACITY];
+    event->name        = span->name;
+    event->start_ns    = span->start_ns;
+    event->duration_ns = end_ns - span->start_ns;
+
+    trace_read_counters(trace_buffer, event->counters);
+    for (size_t i = 0; i < TRACE_COUNTERS; i++) {
+        event->counters[i] -= span->counters[i];
+    }
+
+    trace_buffer->written++;
+}
+
+// Write every thread's spans as Chrome trace JSON, loadable in chrome://tracing or Perfetto
+int trace_export(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        return -1;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    bool first = true;
+    for (TraceBuffer *buffer = atomic_load(&trace_buffers); buffer; buffer = buffer->next) {
+        uint64_t count = buffer->written < TRACE_CAPACITY ? buffer->written : TRACE_CAPACITY;
+
+        for (uint64_t i = buffer->written - count; i < buffer->written; i++) {
+            const TraceEvent *event = &buffer->events[i % TRACE_CAPACITY];
+
+            fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f", first ? "" : ",", event->name, buffer->tid,
+                (double)(event->start_ns - trace_epoch_ns) / 1e3, (double)event->duration_ns / 1e3);
+
+            if (buffer->perf_fds[0] >= 0) {
+                fprintf(f, ",\"args\":{");
+                for (size_t c = 0; c < TRACE_COUNTERS; c++) {
+                    fprintf(f, "%s\"%s\":%llu", c ? "," : "", trace_counter_names[c], (unsigned long long)event->counters[c]);
+                }
+                fprintf(f, "}");
+            }
+
+            fprintf(f, "}");
+            first = false;
+        }
+    }
+
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+#pragma endregion
+#pragma region Drawing
+
+const Color palette[1 << PLANES] = {WHITE, BLACK, GRAY, DARKGRAY}; // Indexed by plane 1 bit << 1 | plane 0 bit
+
+// Each run of same coloured pixels in a row is one rectangle, so the cost follows what's on screen rather than the resolution
+void draw_screen(void)
+{
+    int scale = SCALE * WIDTH / screen_width;
+
+    DrawRectangle(0, 0, WIDTH * SCALE, HEIGHT * SCALE, palette[0]);
+
+    for (uint16_t y = 0; y < screen_height; y++) {
+        for (uint16_t word = 0; word < row_words(); word++) {
+            uint64_t p0                  = framebuffer[0][y][word];
+            uint64_t p1                  = framebuffer[1][y][word];
+            uint64_t colors[1 << PLANES] = {0, p0 & ~p1, ~p0 & p1, p0 & p1};
+
+            for (uint8_t color = 1; color < ARRAY_SIZE(colors); color++) {
+                uint64_t bits = colors[color];
+                while (bits) {
+                    int start     = __builtin_clzll(bits);
+                    uint64_t rest = ~(bits << start);
+                    int length    = rest ? __builtin_clzll(rest) : 64 - start;
+
+                    DrawRectangle((word * 64 + start) * scale, y * scale, length * scale, scale, palette[color]);
+                    bits &= (start + length < 64) ? (UINT64_MAX >> (start + length)) : 0;
+                }
+            }
+        }
+    }
+}
+
+int copy_program_into_RAM(const MappedFile *rom)
+{
+    if (rom->size > ram_size - PROGRAM_BASE_ADDR) {
+        return -1;
+    }
+
+    memcpy(RAM + PROGRAM_BASE_ADDR, rom->data, rom->size);
+    return 0;
+}
+
+#pragma endregion
+#pragma region Streaming
+
+// Framebuffer delta stream, for recording sessions and mirroring the screen into another process.
+// A StreamHeader comes first, then one StreamRecord per frame where something changed, each followed by `rows` rows of a uint8 y and
+// the row's words, plane 0 first. Words go out straight from the framebuffer (leftmost pixel in the top bit), so only the rows set in
+// dirty_rows are sent and an unchanged screen costs nothing. Everything is in host byte order and the header says which that is.
+typedef struct {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t big_endian;
+    uint8_t padding[2];
+} StreamHeader;
+
+typedef struct {
+    uint32_t frame; // Frames since the stream was opened, frames in between had no changes
+    uint8_t row_words;
+    uint8_t height;
+    uint8_t planes;
+    uint8_t rows;
+} StreamRecord;
+
+typedef struct {
+    int fd;
+    uint32_t frame;
+    uint32_t records;
+    uint32_t dropped; // Frames held back while the viewer wasn't keeping up, their rows went out with a later record
+    uint64_t bytes;
+    uint8_t backlog[STREAM_RECORD_MAX]; // The tail of a record the socket only took part of
+    size_t backlog_size;
+} FrameStream;
+
+// writev until everything is out or a non-blocking fd would block. Returns the bytes written, or -1 on error.
+// If only part went out, the rest is copied to backlog so the record can be finished before the next one starts.
+ssize_t write_vector(int fd, struct iovec *iov, int count, uint8_t *backlog, size_t *backlog_size)
+{
+    ssize_t total = 0;
+    *backlog_size = 0;
+
+    while (count > 0) {
+#ifndef _WIN32
+        ssize_t written = writev(fd, iov, count);
+#else
+        ssize_t written = write(fd, iov->iov_base, (unsigned int)iov->iov_len);
+#endif
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && total > 0) {
+                for (; count > 0; iov++, count--) {
+                    memmove(backlog + *backlog_size, iov->iov_base, iov->iov_len);
+                    *backlog_size += iov->iov_len;
+                }
+                return total;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        total += written;
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base  = (uint8_t *)iov->iov_base + written;
+            iov->iov_len  -= (size_t)written;
+        }
+    }
+    return total;
+}
+
+// Open a recording file, or connect to a viewer listening on a Unix socket, and send the header.
+// The socket is non-blocking so a viewer that stalls costs it frames rather than stalling the emulator.
+// Every row is marked dirty so the first record holds the whole screen.
+int stream_open(FrameStream *stream, const char *path, bool to_socket)
+{
+    memset(stream, 0, sizeof(*stream));
+    stream->fd = -1;
+
+    if (to_socket) {
+#ifndef _WIN32
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            return -1;
+        }
+        memcpy(addr.sun_path, path, strlen(path));
+
+        stream->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (stream->fd >= 0 && connect(stream->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(stream->fd);
+            stream->fd = -1;
+        }
+        if (stream->fd >= 0 && fcntl(stream->fd, F_SETFL, fcntl(stream->fd, F_GETFL) | O_NONBLOCK) != 0) {
+            close(stream->fd);
+            stream->fd = -1;
+        }
+        signal(SIGPIPE, SIG_IGN); // A viewer going away shows up as a failed write instead of killing the emulator
+#endif
+    } else {
+        stream->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    }
+    if (stream->fd < 0) {
+        return -1;
+    }
+
+    StreamHeader header = {STREAM_MAGIC, STREAM_VERSION, __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__, {0}};
+    struct iovec iov    = {&header, sizeof(header)};
+    if (write_vector(stream->fd, &iov, 1, stream->backlog, &stream->backlog_size) != (ssize_t)sizeof(header)) {
+        close(stream->fd);
+        stream->fd = -1;
+        return -1;
+    }
+
+    stream->bytes = sizeof(header);
+    dirty_rows    = UINT64_MAX;
+    return 0;
+}
+
+// Send the rows that changed since the last call. Called once per frame.
+// When the viewer isn't keeping up the frame is dropped and its rows stay dirty, so the next record that goes out brings it up to date.
+int stream_frame(FrameStream *stream)
+{
+    if (stream->backlog_size > 0) {
+        struct iovec iov = {stream->backlog, stream->backlog_size};
+        size_t pending   = stream->backlog_size;
+        ssize_t written  = write_vector(stream->fd, &iov, 1, stream->backlog, &stream->backlog_size);
+        if (written < 0) {
+            return -1;
+        }
+        if (written == 0) {
+            stream->backlog_size = pending;
+        }
+    }
+
+    uint32_t frame = stream->frame++;
+    uint64_t rows  = dirty_rows & (UINT64_MAX >> (64 - screen_height));
+    dirty_rows     = 0;
+    if (!rows) {
+        return 0;
+    }
+    if (stream->backlog_size > 0) {
+        dirty_rows |= rows;
+        stream->dropped++;
+        return 0;
+    }
+
+    uint8_t planes      = (quirks == QUIRKS_XOCHIP) ? PLANES : 1;
+    StreamRecord record = {frame, (uint8_t)row_words(), (uint8_t)screen_height, planes, (uint8_t)__builtin_popcountll(rows)};
+    uint8_t ys[HIRES_HEIGHT];
+    struct iovec iov[1 + HIRES_HEIGHT * (1 + PLANES)];
+    int count   = 0;
+    size_t size = sizeof(record);
+
+    iov[count++] = (struct iovec){&record, sizeof(record)};
+    for (uint64_t pending = rows; pending;) {
+        uint8_t y     = (uint8_t)__builtin_ctzll(pending);
+        pending      &= pending - 1;
+        ys[y]         = y;
+        iov[count++]  = (struct iovec){&ys[y], 1};
+        size         += 1;
+
+        for (uint8_t plane = 0; plane < planes; plane++) {
+            iov[count++]  = (struct iovec){framebuffer[plane][y], row_words() * sizeof(uint64_t)};
+            size         += row_words() * sizeof(uint64_t);
+        }
+    }
+
+    ssize_t written = write_vector(stream->fd, iov, count, stream->backlog, &stream->backlog_size);
+    if (written < 0) {
+        return -1;
+    }
+    if (written == 0) {
+        dirty_rows |= rows;
+        stream->dropped++;
+        return 0;
+    }
+    stream->records++;
+    stream->bytes += size;
+    return 0;
+}
+
+void stream_close(FrameStream *stream)
+{
+    if (stream->fd < 0) {
+        return;
+    }
+
+    uint64_t whole_screen = (uint64_t)screen_height * row_words() * sizeof(uint64_t) * ((quirks == QUIRKS_XOCHIP) ? PLANES : 1);
+    printf("NOTE: Streamed %u of %u frames (%u held back for a slow viewer) in %llu bytes, %llu bytes per frame against %llu for the whole screen\n",
+        stream->records, stream->frame, stream->dropped, (unsigned long long)stream->bytes, (unsigned long long)(stream->frame ? stream->bytes / stream->frame : 0), (unsigned long long)whole_screen);
+    close(stream->fd);
+    stream->fd = -1;
+}
+
+// Palette indices of the visible framebuffer at window size, one byte per pixel
+void render_indices(uint8_t *pixels)
+{
+    int scale = SCALE * WIDTH / screen_width;
+
+    for (int y = 0; y < HEIGHT * SCALE; y++) {
+        for (int x = 0; x < WIDTH * SCALE; x++) {
+            uint16_t fx = (uint16_t)(x / scale);
+            uint16_t fy = (uint16_t)(y / scale);
+
+            *pixels++ = (uint8_t)(framebuffer_pixel(1, fx, fy) << 1 | framebuffer_pixel(0, fx, fy));
+        }
+    }
+}
+
+typedef struct {
+    FILE *file;
+    uint32_t bits; // Codes not yet packed into bytes, least significant bit first
+    uint8_t bit_count;
+    uint8_t block[255]; // Image data is written in sub-blocks of up to 255 bytes
+    uint8_t block_size;
+    uint16_t codes[GIF_MAX_CODE + 1][1 << PLANES]; // LZW dictionary, codes[prefix][pixel] is the code for prefix followed by pixel
+} GifWriter;
+
+void gif_put_u16(GifWriter *gif, uint16_t value)
+{
+    fputc(value & 0xFF, gif->file);
+    fputc(value >> 8, gif->file);
+}
+
+void gif_flush_block(GifWriter *gif)
+{
+    if (gif->block_size) {
+        fputc(gif->block_size, gif->file);
+        fwrite(gif->block, 1, gif->block_size, gif->file);
+        gif->block_size = 0;
+    }
+}
+
+void gif_put_code(GifWriter *gif, uint16_t code, uint8_t size)
+{
+    gif->bits      |= (uint32_t)code << gif->bit_count;
+    gif->bit_count += size;
+
+    while (gif->bit_count >= 8) {
+        gif->block[gif->block_size++]  = (uint8_t)gif->bits;
+        gif->bits                    >>= 8;
+        gif->bit_count                -= 8;
+        if (gif->block_size == sizeof(gif->block)) {
+            gif_flush_block(gif);
+        }
+    }
+}
+
+// GIF89a header with the 4 colour palette, looping forever
+void gif_begin(GifWriter *gif, FILE *file)
+{
+    memset(gif, 0, sizeof(*gif));
+    gif->file = file;
+
+    fwrite("GIF89a", 1, 6, file);
+    gif_put_u16(gif, WIDTH * SCALE);
+    gif_put_u16(gif, HEIGHT * SCALE);
+    fputc(0x91, file); // Global colour table of 2^(1 + 1) colours, 2 bits per primary
+    fputc(0, file);    // Background colour
+    fputc(0, file);    // Square pixels
+    for (uint8_t color = 0; color < ARRAY_SIZE(palette); color++) {
+        fputc(palette[color].r, file);
+        fputc(palette[color].g, file);
+        fputc(palette[color].b, file);
+    }
+
+    fwrite("\x21\xFF\x0BNETSCAPE2.0\x03\x01\x00\x00\x00", 1, 19, file);
+}
+
+// One full frame shown for delay centiseconds, LZW coded the way GIF wants: variable width codes from GIF_MIN_CODE_SIZE + 1 bits up
+// to 12, with a clear code whenever the dictionary fills up
+void gif_frame(GifWriter *gif, const uint8_t *pixels, uint16_t delay)
+{
+    const uint16_t clear = 1 << GIF_MIN_CODE_SIZE;
+    const uint16_t end   = clear + 1;
+    const size_t count   = (size_t)WIDTH * SCALE * HEIGHT * SCALE;
+
+    fwrite("\x21\xF9\x04\x00", 1, 4, gif->file); // Graphic control extension
+    gif_put_u16(gif, delay);
+    fwrite("\x00\x00", 1, 2, gif->file);
+
+    fputc(0x2C, gif->file); // Image descriptor covering the whole screen
+    gif_put_u16(gif, 0);
+    gif_put_u16(gif, 0);
+    gif_put_u16(gif, WIDTH * SCALE);
+    gif_put_u16(gif, HEIGHT * SCALE);
+    fputc(0, gif->file);
+    fputc(GIF_MIN_CODE_SIZE, gif->file);
+
+    memset(gif->codes, 0, sizeof(gif->codes));
+    uint8_t size    = GIF_MIN_CODE_SIZE + 1;
+    uint16_t next   = end;
+    uint16_t prefix = pixels[0];
+    gif_put_code(gif, clear, size);
+
+    for (size_t i = 1; i < count; i++) {
+        uint8_t pixel = pixels[i];
+        if (gif->codes[prefix][pixel]) {
+            prefix = gif->codes[prefix][pixel];
+            continue;
+        }
+
+        gif_put_code(gif, prefix, size);
+        gif->codes[prefix][pixel] = ++next;
+        if (next >= (1U << size)) {
+            size++;
+        }
+        if (next == GIF_MAX_CODE) {
+            gif_put_code(gif, clear, size);
+            memset(gif->codes, 0, sizeof(gif->codes));
+            size = GIF_MIN_CODE_SIZE + 1;
+            next = end;
+        }
+        prefix = pixel;
+    }
+
+    // A reader adds one more entry after the last prefix, so the end code is one bit wider when that entry fills the current width
+    gif_put_code(gif, prefix, size);
+    if ((uint32_t)next + 1 >= (1U << size) && size < 12) {
+        size++;
+    }
+    gif_put_code(gif, end, size);
+    if (gif->bit_count) {
+        gif_put_code(gif, 0, (uint8_t)(8 - gif->bit_count));
+    }
+    gif_flush_block(gif);
+    fputc(0, gif->file);
+}
+
+typedef struct {
+    uint16_t prefix[GIF_MAX_CODE + 1]; // A code's string is its prefix's string followed by pixel
+    uint8_t pixel[GIF_MAX_CODE + 1];
+    uint8_t first[GIF_MAX_CODE + 1];
+    uint32_t length[GIF_MAX_CODE + 1];
+} GifDictionary;
+
+// Read the next size bit code from the image data sub-blocks, or -1 at the terminating empty block
+int gif_get_code(FILE *file, uint32_t *bits, uint8_t *bit_count, int *block_left, uint8_t size)
+{
+    while (*bit_count < size) {
+        if (*block_left == 0 && (*block_left = fgetc(file)) <= 0) {
+            return -1;
+        }
+        int byte = fgetc(file);
+        if (byte == EOF) {
+            return -1;
+        }
+        (*block_left)--;
+        *bits      |= (uint32_t)byte << *bit_count;
+        *bit_count += 8;
+    }
+
+    int code     = (int)(*bits & ((1U << size) - 1));
+    *bits      >>= size;
+    *bit_count  -= size;
+    return code;
+}
+
+// Decode one frame written by gif_frame into count palette indices, checking that it ends with the end code right after the last pixel
+int gif_decode_frame(FILE *file, GifDictionary *dict, uint8_t *pixels, size_t count)
+{
+    const uint16_t clear = 1 << GIF_MIN_CODE_SIZE;
+    const uint16_t end   = clear + 1;
+
+    // Skip the graphic control extension and image descriptor, both fixed size here
+    if (fseek(file, 8 + 10, SEEK_SET) != 0 || fgetc(file) != GIF_MIN_CODE_SIZE) {
+        printf("ERROR: GIF frame has the wrong minimum code size\n");
+        return -1;
+    }
+
+    for (uint16_t code = 0; code < clear; code++) {
+        dict->pixel[code]  = (uint8_t)code;
+        dict->first[code]  = (uint8_t)code;
+        dict->length[code] = 1;
+    }
+
+    uint32_t bits     = 0;
+    uint8_t bit_count = 0;
+    int block_left    = 0;
+    uint8_t size      = GIF_MIN_CODE_SIZE + 1;
+    uint16_t next     = end + 1;
+    int previous      = -1;
+    size_t position   = 0;
+
+    for (;;) {
+        int code = gif_get_code(file, &bits, &bit_count, &block_left, size);
+        if (code < 0) {
+            printf("ERROR: GIF frame ran out of data at pixel %zu of %zu without an end code\n", position, count);
+            return -1;
+        }
+        if (code == clear) {
+            size     = GIF_MIN_CODE_SIZE + 1;
+            next     = end + 1;
+            previous = -1;
+            continue;
+        }
+        if (code == end) {
+            break;
+        }
+        if (code > next || (previous < 0 && code >= clear)) {
+            printf("ERROR: GIF frame has code %d with only %u defined at pixel %zu of %zu\n", code, next, position, count);
+            return -1;
+        }
+
+        // A reader adds the previous code plus this one's first pixel, and widens codes as soon as the next one wouldn't fit
+        if (previous >= 0 && next <= GIF_MAX_CODE) {
+            dict->prefix[next] = (uint16_t)previous;
+            dict->pixel[next]  = dict->first[code == next ? previous : code];
+            dict->first[next]  = dict->first[previous];
+            dict->length[next] = dict->length[previous] + 1;
+            next++;
+            if (next == (1U << size) && size < 12) {
+                size++;
+            }
+        }
+
+        if (position + dict->length[code] > count) {
+            printf("ERROR: GIF frame decodes to more than %zu pixels\n", count);
+            return -1;
+        }
+        uint16_t at = (uint16_t)code;
+        for (uint32_t i = dict->length[code]; i > 0; i--) {
+            pixels[position + i - 1] = dict->pixel[at];
+            at                       = dict->prefix[at];
+        }
+        position += dict->length[code];
+        previous  = code;
+    }
+
+    if (position != count) {
+        printf("ERROR: GIF frame ended at pixel %zu of %zu\n", position, count);
+        return -1;
+    }
+    return 0;
+}
+
+// Encode the visible screen with gif_frame and decode it again, so getting the code widths wrong fails the conformance run
+// instead of producing recordings that stop part way through a frame
+int gif_round_trip(void)
+{
+    const size_t count = (size_t)WIDTH * SCALE * HEIGHT * SCALE;
+
+    FILE *file          = tmpfile();
+    GifWriter *gif      = malloc(sizeof(*gif));
+    GifDictionary *dict = malloc(sizeof(*dict));
+    uint8_t *pixels     = malloc(count);
+    uint8_t *decoded    = malloc(count);
+    int result          = -1;
+
+    if (file && gif && dict && pixels && decoded) {
+        render_indices(pixels);
+        memset(gif, 0, sizeof(*gif));
+        gif->file = file;
+        gif_frame(gif, pixels, GIF_MIN_DELAY);
+
+        result = gif_decode_frame(file, dict, decoded, count);
+        for (size_t i = 0; result == 0 && i < count; i++) {
+            if (decoded[i] != pixels[i]) {
+                printf("ERROR: GIF frame decodes to colour %d instead of %d at pixel %zu\n", decoded[i], pixels[i], i);
+                result = -1;
+            }
+        }
+    } else {
+        printf("ERROR: Out of memory for the GIF round trip\n");
+    }
+
+    if (file) {
+        fclose(file);
+    }
+    free(decoded);
+    free(pixels);
+    free(dict);
+    free(gif);
+    return result;
+}
+
+uint64_t frame_centiseconds(uint32_t frame)
+{
+    return (uint64_t)frame * 100 / FPS_TARGET;
+}
+
+// Replay a recording (or - for stdin) into the framebuffer, writing each recorded frame to DIR as a PNG and the whole thing as GIF_FILENAME
+int stream_export(const char *path, const char *dir)
+{
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!in) {
+        printf("ERROR: Failed to open %s\n", path);
+        return -1;
+    }
+
+    StreamHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.version != STREAM_VERSION) {
+        printf("ERROR: %s is not a frame stream this build understands\n", path);
+        fclose(in);
+        return -1;
+    }
+    bool swap = header.big_endian != (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+    if ((swap ? __builtin_bswap32(header.magic) : header.magic) != STREAM_MAGIC) {
+        printf("ERROR: %s is not a frame stream this build understands\n", path);
+        fclose(in);
+        return -1;
+    }
+
+    char out_path[ROM_PATH_MAX];
+    snprintf(out_path, sizeof(out_path), "%s/%s", dir, GIF_FILENAME);
+    FILE *out = fopen(out_path, "wb");
+    if (!out) {
+        printf("ERROR: Failed to create %s\n", out_path);
+        fclose(in);
+        return -1;
+    }
+
+    GifWriter *gif  = malloc(sizeof(*gif));
+    uint8_t *pixels = malloc((size_t)WIDTH * SCALE * HEIGHT * SCALE);
+    Image image     = GenImageColor(WIDTH * SCALE, HEIGHT * SCALE, palette[0]);
+    gif_begin(gif, out);
+
+    memset(framebuffer, 0, sizeof(framebuffer));
+    screen_width  = WIDTH;
+    screen_height = HEIGHT;
+
+    // Browsers stretch GIF delays under GIF_MIN_DELAY, so a frame that would be shown for less is dropped in favour of the next one
+    uint32_t frames   = 0;
+    uint64_t shown_at = 0;
+    int result        = 0;
+    StreamRecord record;
+
+    while (fread(&record, sizeof(record), 1, in) == 1) {
+        uint32_t frame = swap ? __builtin_bswap32(record.frame) : record.frame;
+        if (record.row_words < 1 || record.row_words > ROW_WORDS || record.height > HIRES_HEIGHT || record.planes < 1 || record.planes > PLANES ||
+            record.rows > record.height) {
+            printf("ERROR: %s is corrupt at frame %u\n", path, frame);
+            result = -1;
+            break;
+        }
+
+        if (frames == 0) {
+            shown_at = frame_centiseconds(frame);
+        } else if (frame_centiseconds(frame) - shown_at >= GIF_MIN_DELAY) {
+            gif_frame(gif, pixels, (uint16_t)(frame_centiseconds(frame) - shown_at));
+            shown_at = frame_centiseconds(frame);
+        }
+
+        screen_width  = (uint16_t)(record.row_words * 64);
+        screen_height = record.height;
+        for (uint8_t row = 0; row < record.rows && result == 0; row++) {
+            uint8_t y;
+            if (fread(&y, 1, 1, in) != 1 || y >= screen_height) {
+                result = -1;
+                break;
+            }
+
+            memset(framebuffer[1][y], 0, sizeof(framebuffer[1][y]));
+            for (uint8_t plane = 0; plane < record.planes; plane++) {
+                if (fread(framebuffer[plane][y], sizeof(uint64_t), record.row_words, in) != record.row_words) {
+                    result = -1;
+                    break;
+                }
+                for (uint8_t word = 0; swap && word < record.row_words; word++) {
+                    framebuffer[plane][y][word] = __builtin_bswap64(framebuffer[plane][y][word]);
+                }
+            }
+        }
+        if (result != 0) {
+            printf("ERROR: %s is truncated at frame %u\n", path, frame);
+            break;
+        }
+
+        render_indices(pixels);
+        Color *colors = image.data;
+        for (size_t i = 0; i < (size_t)WIDTH * SCALE * HEIGHT * SCALE; i++) {
+            colors[i] = palette[pixels[i]];
+        }
+        snprintf(out_path, sizeof(out_path), "%s/frame_%06u.png", dir, frame);
+        if (!ExportImage(image, out_path)) {
+            printf("ERROR: Failed to write %s\n", out_path);
+            result = -1;
+            break;
+        }
+        frames++;
+    }
+
+    if (frames > 0) {
+        gif_frame(gif, pixels, GIF_MIN_DELAY);
+    }
+    fputc(0x3B, out); // Trailer
+    if (fclose(out) != 0) {
+        result = -1;
+    }
+
+    if (result == 0) {
+        printf("NOTE: Exported %u frames from %s to %s\n", frames, path, dir);
+    }
+
+    UnloadImage(image);
+    free(pixels);
+    free(gif);
+    if (in != stdin) {
+        fclose(in);
+    }
+    return result;
+}
+
+#pragma endregion
+#pragma region Conformance
+
+typedef struct {
+    const char *name;    // File name inside the test directory
+    QuirkProfile quirks; // The golden only holds for this machine, so it's never left to guess_quirks
+    uint32_t stream;     // RNG stream under DEFAULT_SEED, so RND results are pinned too
+    uint64_t golden;     // framebuffer_hash() of the screen the ROM should end on
+    bool sctest;         // Decode SCTEST's error screen when the hash doesn't match
+} ConformanceTest;
+
+static const ConformanceTest conformance_tests[] = {
+    {"SCTEST",           QUIRKS_SCHIP,  0, 0x99186197910ef873ULL, true },
+    {"IBM Logo.ch8",     QUIRKS_CHIP8,  0, 0xc094f65422bd4e58ULL, false},
+    {"hires-scroll.sc8", QUIRKS_SCHIP,  0, 0xdd4ecb54173fbe12ULL, false},
+    {"xo-planes.xo8",    QUIRKS_XOCHIP, 0, 0xe975969b810365f1ULL, false},
+    {"rnd.ch8",          QUIRKS_CHIP8,  0, 0x4d39d9d7ce6f36c5ULL, false},
+    {"rnd.ch8",          QUIRKS_CHIP8,  1, 0x2d91172b36f1743dULL, false},
+};
+
+typedef enum {
+    RUN_HALTED,
+    RUN_STABLE,
+    RUN_TIMEOUT,
+    RUN_FAULT,
+} RunResult;
+
+static const char *run_result_names[] = {"halted", "stable", "timed out", "faulted"};
+
+// Hash of the visible part of the bit planes, one bit per pixel with the leftmost pixel in the top bit of the first byte.
+// Only XO-CHIP can light the second plane, so it's left out otherwise.
+uint64_t framebuffer_hash(void)
+{
+    uint64_t hash  = FNV1A_INIT;
+    uint8_t planes = (quirks == QUIRKS_XOCHIP) ? PLANES : 1;
+
+    for (uint8_t plane = 0; plane < planes; plane++) {
+        for (uint16_t y = 0; y < screen_height; y++) {
+            for (uint16_t word = 0; word < row_words(); word++) {
+                uint8_t bytes[8];
+                for (uint8_t b = 0; b < sizeof(bytes); b++) {
+                    bytes[b] = (uint8_t)(framebuffer[plane][y][word] >> (56 - 8 * b));
+                }
+                hash = fnv1a(hash, bytes, sizeof(bytes));
+            }
+        }
+    }
+    return hash;
+}
+
+// Run without a window until the ROM parks itself on a jump to its own address or EXIT, the screen stops changing, or the machine faults
+RunResult run_headless(uint32_t *frames)
+{
+    uint64_t last_hash = framebuffer_hash();
+    uint32_t stable    = 0;
+
+    for (*frames = 1; *frames <= CONFORMANCE_MAX_FRAMES; (*frames)++) {
+        tick_timers();
+
+        for (int step = 0; step < CPU_STEPS_PER_FRAME; step++) {
+            if ((uint32_t)PC + 1 < ram_size) {
+                uint16_t next = (uint16_t)((RAM[PC] << 8U) | RAM[PC + 1]);
+                if (((next & 0xF000) == 0x1000 && NNN(next) == PC) || next == 0x00FD) {
+                    return RUN_HALTED;
+                }
+            }
+
+            if (!cpu_step()) {
+                return RUN_FAULT;
+            }
+        }
+
+        uint64_t hash = framebuffer_hash();
+        stable        = (hash == last_hash) ? stable + 1 : 0;
+        last_hash     = hash;
+        if (stable >= CONFORMANCE_STABLE_FRAMES) {
+            return RUN_STABLE;
+        }
+    }
+    return RUN_TIMEOUT;
+}
+
+typedef struct {
+    char symbol;
+    uint8_t rows[5];
+} Glyph;
+
+// Letters test/sctest.c8 draws from its own sprites rather than the system font
+static const Glyph sctest_glyphs[] = {
+    {'I', {0xF8, 0x20, 0x20, 0x20, 0xF8}},
+    {'N', {0x88, 0xC8, 0xA8, 0x98, 0x88}},
+    {'1', {0x10, 0x30, 0x10, 0x10, 0x10}},
+};
+
+// Indexed by the number SCTEST prints after "ERROR", see test/sctest.txt and test/sctest.c8
+static const char *sctest_errors[] = {
+    "Fx65 can't load zeroes from memory into registers",
+    "8x5 system font not found",
+    "VF not cleared by 254 + 1",
+    "254 + 1 didn't give 255",
+    "VF not set by 255 + 1",
+    "255 + 1 didn't give 0",
+    "VF not set by 1 - 1",
+    "1 - 1 didn't give 0",
+    "VF not cleared by 0 - 1",
+    "0 - 1 didn't give 255",
+    "VF not set by SUBN 1 - 1",
+    "SUBN 1 - 1 didn't give 0",
+    "VF not cleared by SUBN 0 - 1",
+    "SUBN 0 - 1 didn't give 255",
+    "VF not set by 255 SHR 1",
+    "255 SHR 1 didn't give 127",
+    "VF not cleared by 64 SHR 1",
+    "64 SHR 1 didn't give 32",
+    "VF not cleared by 32 SHL 1",
+    "32 SHL 1 didn't give 64",
+    "VF not set by 250 SHL 1",
+    "250 SHL 1 didn't give 244",
+    "XOR gave the wrong result",
+    "Fx75/Fx85 can't restore the HP48 flags",
+    "VF not set when Fx1E overflows I past 0xFFF",
+};
+
+// Match the 5x5 block of pixels at (x, 0) against the system font and SCTEST's own letters
+char sctest_glyph_at(uint16_t x)
+{
+    uint8_t rows[5] = {0};
+    for (uint16_t y = 0; y < ARRAY_SIZE(rows); y++) {
+        for (uint16_t col = 0; col < 5 && x + col < screen_width; col++) {
+            rows[y] |= (uint8_t)(framebuffer_pixel(0, (uint16_t)(x + col), y) << (7 - col));
+        }
+    }
+
+    for (uint8_t digit = 0; digit < 16; digit++) {
+        if (memcmp(rows, &font_sprites[digit * 5], sizeof(rows)) == 0) {
+            return "0123456789ABCDEF"[digit];
+        }
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(sctest_glyphs); i++) {
+        if (memcmp(rows, sctest_glyphs[i].rows, sizeof(rows)) == 0) {
+            return sctest_glyphs[i].symbol;
+        }
+    }
+    return '\0';
+}
+
+// Read back whatever SCTEST printed after "ERROR" and explain it
+void sctest_report(void)
+{
+    char text[8] = {0};
+    size_t length = 0;
+
+    for (uint16_t x = SCTEST_ERROR_TEXT_X; x + 5 <= screen_width && length + 1 < sizeof(text);) {
+        char symbol = sctest_glyph_at(x);
+        if (symbol) {
+            text[length++] = symbol;
+            x += 5;
+        } else {
+            x++;
+        }
+    }
+
+    if (length == 0) {
+        printf("     SCTEST stopped before printing an error\n");
+    } else if (strcmp(text, "INI") == 0) {
+        printf("     SCTEST reports ERROR INI: registers weren't zero at startup\n");
+    } else if (strcmp(text, "BCD") == 0) {
+        printf("     SCTEST reports ERROR BCD: Fx33 stored the wrong digits\n");
+    } else if (strspn(text, "0123456789") == length) {
+        unsigned long error = strtoul(text, NULL, 10);
+        printf("     SCTEST reports ERROR %lu: %s\n", error, error < ARRAY_SIZE(sctest_errors) ? sctest_errors[error] : "unknown error");
+    } else {
+        printf("     SCTEST reports ERROR %s\n", text);
+    }
+}
+
+// Run every golden test found in dir, and record passing framebuffer hashes in the catalog if dir has one.
+// Each test is run a second time from a snapshot of its start, which has to end on the same screen after the same number of frames.
+// Returns the number of failures.
+int run_conformance(const char *dir)
+{
+    RomCatalog catalog = {0};
+    if (catalog_load(&catalog, dir) != 0) {
+        catalog_free(&catalog);
+    }
+
+    Snapshot *start_state = malloc(sizeof(Snapshot));
+    if (!start_state) {
+        catalog_free(&catalog);
+        return (int)ARRAY_SIZE(conformance_tests);
+    }
+
+    int failures = 0;
+    for (size_t t = 0; t < ARRAY_SIZE(conformance_tests); t++) {
+        const ConformanceTest *test = &conformance_tests[t];
+        uint64_t start              = time_now_ns();
+
+        char path[ROM_PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, test->name);
+
+        MappedFile rom;
+        if (map_file(path, &rom) != 0) {
+            printf("FAIL %s: can't map %s\n", test->name, path);
+            failures++;
+            continue;
+        }
+
+        // Every test reseeds, so results don't depend on which tests ran before.
+        // The lookup only makes sure the catalog has an entry to record a passing hash in.
+        lookup_rom(&catalog, path, &rom);
+        machine_reset(test->quirks, DEFAULT_SEED, test->stream);
+        if (copy_program_into_RAM(&rom) != 0) {
+            printf("FAIL %s: doesn't fit in RAM\n", test->name);
+            unmap_file(&rom);
+            failures++;
+            continue;
+        }
+
+        snapshot_save(start_state);
+        uint32_t frames  = 0;
+        RunResult result = run_headless(&frames);
+        uint64_t hash    = framebuffer_hash();
+        double ms        = (double)(time_now_ns() - start) / 1e6;
+
+        uint32_t replay_frames  = 0;
+        uint64_t replay_hash    = hash;
+        RunResult replay_result = result;
+        if (result != RUN_FAULT) {
+            snapshot_restore(start_state);
+            replay_result = run_headless(&replay_frames);
+            replay_hash   = framebuffer_hash();
+        }
+
+        if (result != RUN_FAULT && hash == test->golden && (replay_result != result || replay_frames != frames || replay_hash != hash)) {
+            printf("FAIL %s as %s, stream %u: replaying from a snapshot %s after %u frames on framebuffer %016llx, the first run %s after %u frames\n", test->name,
+                quirk_names[quirks], test->stream, run_result_names[replay_result], replay_frames, (unsigned long long)replay_hash, run_result_names[result], frames);
+            failures++;
+        } else if (result != RUN_FAULT && hash == test->golden && gif_round_trip() != 0) {
+            printf("FAIL %s as %s, stream %u: the final screen doesn't survive a GIF round trip\n", test->name, quirk_names[quirks], test->stream);
+            failures++;
+        } else if (result != RUN_FAULT && hash == test->golden) {
+            printf("PASS %s as %s, stream %u (%s after %u frames, %.2f ms)\n", test->name, quirk_names[quirks], test->stream, run_result_names[result], frames, ms);
+
+            RomEntry *cached = catalog_find_name(&catalog, test->name);
+            if (cached && cached->good_framebuffer_hash != hash) {
+                cached->good_framebuffer_hash = hash;
+                catalog_save(&catalog);
+            }
+        } else {
+            printf("FAIL %s as %s, stream %u (%s after %u frames, %.2f ms): framebuffer %016llx, expected %016llx\n", test->name, quirk_names[quirks], test->stream, run_result_names[result], frames,
+                ms, (unsigned long long)hash, (unsigned long long)test->golden);
+            if (test->sctest) {
+                sctest_report();
+            }
+            failures++;
+        }
+
+        unmap_file(&rom);
+    }
+
+    free(start_state);
+    catalog_free(&catalog);
+    return failures;
 }
 
-int main(void)
+#pragma endregion
+#pragma region Main
+
+// Usage: chip8 [--catalog DIR] [--mode chip8|schip|xochip] [--seed N] [--trace FILE [--perf]] [--quiet] [--debug] [--break ADDR]...
+//              [--record FILE | --stream SOCKET] [ROM]
+//        chip8 --conform [DIR]
+//        chip8 --export RECORDING DIR
+// With --catalog and no ROM the catalog of DIR is brought up to date and nothing is run.
+// With --debug or --break, Ctrl-C in the terminal stops the running program at the debugger prompt.
+// With --conform the golden tests in DIR (TEST_DIR by default) are run headless, exiting non-zero if any fail.
+// --record and --stream send the framebuffer delta stream to a file or a viewer listening on a Unix socket, --export turns a recording
+// (- for stdin) into a PNG per recorded frame and an animated GIF.
+int main(int argc, char **argv)
 {
+    const char *rom_path    = NULL;
+    const char *catalog_dir = NULL;
+    const char *trace_path  = NULL;
+    const char *stream_path = NULL;
+    bool stream_socket      = false;
+    const char *export_dir  = NULL;
+    bool perf_counters      = false;
+    uint64_t seed           = DEFAULT_SEED;
+    bool conform            = false;
+    bool debug              = false; // --debug or --break, Ctrl-C then breaks into the debugger instead of quitting
+    int mode                = -1; // A QuirkProfile, or -1 to use the catalog's guess
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--catalog") == 0 && i + 1 < argc) {
+            catalog_dir = argv[++i];
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            perf_counters = true;
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            verbose = false;
+        } else if (strcmp(argv[i], "--conform") == 0) {
+            conform = true;
+        } else if (strcmp(argv[i], "--debug") == 0) {
+            verbose           = false;
+            debug             = true;
+            debugger.stepping = true;
+        } else if (strcmp(argv[i], "--break") == 0 && i + 1 < argc) {
+            verbose = false;
+            debug   = true;
+            debug_set_breakpoint((uint16_t)strtoul(argv[++i], NULL, 16), true);
+        } else if ((strcmp(argv[i], "--record") == 0 || strcmp(argv[i], "--stream") == 0) && i + 1 < argc) {
+            stream_socket = strcmp(argv[i], "--stream") == 0;
+            stream_path   = argv[++i];
+        } else if (strcmp(argv[i], "--export") == 0 && i + 2 < argc) {
+            stream_path = argv[++i];
+            export_dir  = argv[++i];
+        } else if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+            const char *modes[] = {"chip8", "schip", "xochip"};
+            i++;
+            for (int m = 0; m < (int)ARRAY_SIZE(modes); m++) {
+                if (strcmp(argv[i], modes[m]) == 0) {
+                    mode = m;
+                }
+            }
+        } else {
+            rom_path = argv[i];
+        }
+    }
+
+    if (conform) {
+        verbose  = false;
+        RAM      = calloc(XO_RAM_SIZE, 1);
+        int fail = run_conformance(rom_path ? rom_path : TEST_DIR);
+        free(RAM);
+        return fail ? 1 : 0;
+    }
+
+    if (export_dir) {
+        return stream_export(stream_path, export_dir);
+    }
+
+    RomCatalog catalog = {0};
+    if (catalog_dir) {
+        if (catalog_scan(&catalog, catalog_dir) != 0) {
+            printf("ERROR: Failed to read ROM directory %s\n", catalog_dir);
+            return -1;
+        }
+        if (!rom_path) {
+            catalog_free(&catalog);
+            return 0;
+        }
+    } else {
+        rom_path = rom_path ? rom_path : FILENAME;
+
+        // Reuse the catalog next to the ROM if one has been built, but don't create one unasked
+        char dir[ROM_PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", rom_path);
+        char *slash = strrchr(dir, '/');
+        if (slash) {
+            *slash = '\0';
+        } else {
+            snprintf(dir, sizeof(dir), ".");
+        }
+        if (catalog_load(&catalog, dir) != 0) {
+            catalog_free(&catalog);
+        }
+    }
+
+    MappedFile rom;
+    if (map_file(rom_path, &rom) != 0) {
+        printf("ERROR: Failed to map %s\n", rom_path);
+        catalog_free(&catalog);
+        return -1;
+    }
+
+    RomEntry entry = lookup_rom(&catalog, rom_path, &rom);
+    printf("NOTE: %s is %u bytes, hash %016llx, looks like %s (%u reachable instructions)\n", rom_path, entry.size, (unsigned long long)entry.hash, quirk_names[entry.quirks],
+        entry.analysis.reachable);
+    catalog_free(&catalog);
+
     InitWindow(WIDTH * SCALE, HEIGHT * SCALE, "chip-8");
     SetTargetFPS(FPS_TARGET);
 
-    RAM = calloc(RAM_SIZE, 1);
-    memcpy(RAM + FONT_BASE_ADDR, font_sprites, (size_t)FONT_BYTES);
+    RAM = calloc(XO_RAM_SIZE, 1);
+    machine_reset(mode >= 0 ? (QuirkProfile)mode : (QuirkProfile)entry.quirks, seed, 0);
+    printf("NOTE: Running as %s\n", quirk_names[quirks]);
+    debug_rearm();
+    if (debug) {
+        signal(SIGINT, debug_interrupt);
+    }
 
-    int result = copy_program_into_RAM();
+    int result = copy_program_into_RAM(&rom);
+    unmap_file(&rom);
     if (result != 0) {
         printf("ERROR: Failed to copy program into RAM\n");
         free(RAM);
@@ -770,39 +3580,67 @@ int main(void)
 
     printf("NOTE: Copied program into RAM\n");
 
-    PC              = PROGRAM_BASE_ADDR;
-    uint16_t opcode = 0;
+    if (trace_path) {
+        trace_start(perf_counters);
+    }
+
+    FrameStream stream = {.fd = -1};
+    if (stream_path && stream_open(&stream, stream_path, stream_socket) != 0) {
+        printf("WARNING: Failed to open frame stream %s, running without it\n", stream_path);
+    }
 
     while (!WindowShouldClose()) {
-        if (DT > 0) {
-            DT--;
+        TraceSpan frame_span = trace_begin("frame");
+
+        tick_timers();
+
+        TraceSpan span = trace_begin("poll_keypad");
+        poll_keypad();
+        trace_end(&span);
+
+        if (debug_interrupted) {
+            debug_break_in();
         }
 
-        if (ST > 0) {
-            ST--;
+        span = trace_begin("execute");
+        bool running = run_steps(CPU_STEPS_PER_FRAME);
+        trace_end(&span);
+
+        if (!running) {
+            break;
         }
 
-        for (int step = 0; step < CPU_STEPS_PER_FRAME; step++) {
-            if (PC + 1 >= PROGRAM_REGION_END) {
-                printf("ERROR: Program counter 0x%04x above region 0x%04x\n", PC + 1, PROGRAM_REGION_END);
-                assert(false);
+        if (stream.fd >= 0) {
+            span = trace_begin("stream_frame");
+            if (stream_frame(&stream) != 0) {
+                printf("WARNING: Lost frame stream %s, running without it\n", stream_path);
+                stream_close(&stream);
             }
-
-            opcode = (uint16_t)((RAM[PC] << 8U) | RAM[PC + 1]);
-            printf("Opcode 0x%04x, PC 0x%04x\n", opcode, PC);
-            PC += 2;
-            handle_opcode(opcode);
+            trace_end(&span);
         }
 
         BeginDrawing();
         ClearBackground(RAYWHITE);
+
+        span = trace_begin("draw_screen");
         draw_screen();
+        trace_end(&span);
+
+        span = trace_begin("EndDrawing");
         EndDrawing();
+        trace_end(&span);
+
+        trace_end(&frame_span);
+    }
+
+    if (trace_path && trace_export(trace_path) != 0) {
+        printf("WARNING: Failed to write trace to %s\n", trace_path);
     }
 
+    stream_close(&stream);
     free(RAM);
     CloseWindow();
-    return 0;
+    return cpu_fault ? -1 : 0;
 }
 
 #pragma endregion